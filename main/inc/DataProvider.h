@@ -1,9 +1,90 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 #include "tensorflow/lite/c/common.h"
 #include "tcp_server.h"
+#include "protocol.h"
+#include "quantization.h"
+#include "Preprocessor.h"
+
+// Normalization of raw pixels (INPUT_ENCODING_PIXEL_UINT8), applied after scaling them to [0, 1]
+#ifndef PIXEL_MEAN
+#define PIXEL_MEAN 0.0f
+#endif
+#ifndef PIXEL_STD
+#define PIXEL_STD 1.0f
+#endif
+
+// Where the input data of a request are received from
+struct InputSource {
+	void* context;
+	// Receives exactly `size` bytes, returns <= 0 on failure
+	ssize_t (*receive)(void* context, void* buffer, size_t size);
+};
+
+struct Request {
+	uint8_t type;
+	uint8_t sample_count;
+	uint8_t input_encoding;
+	uint8_t response_mode;
+	uint8_t top_k;
+	float threshold;
+	uint32_t request_id;
+	PreprocessConfig preprocess;
+	// Bytes following the header that are discarded: the normalization of a
+	// REQUEST_SET_PREPROCESS with an invalid channel count
+	uint16_t skip;
+};
+
+// Decoding state of a sample received in pieces
+struct SampleProgress {
+	uint8_t encoding;
+	// Bytes of the encoded sample decoded so far
+	size_t offset;
+	// Leading bytes of a float32 value split across pieces
+	uint8_t partial[sizeof(float)];
+};
 
 class DataProvider {
 	public:
-	int Read(int client_socket, TfLiteTensor* modelInput);
+	// Resolves the quantize kernel of the input tensor and builds the pixel lookup table once
+	void Init(const TfLiteTensor* modelInput);
+	// Parses the header of a request from the `size` bytes received so far. Returns the number
+	// of header bytes still missing, 0 once `request` is complete and -1 for malformed requests.
+	int ParseRequest(const uint8_t* header, size_t size, Request& request);
+	// Starts decoding a sample in the given encoding
+	void Begin(SampleProgress& progress, uint8_t encoding);
+	// Decodes the next `size` bytes of the sample into `output` (modelInput->bytes long), converted to the
+	// type of the input tensor. The pieces may split values anywhere, but never go past the encoded size.
+	void Decode(SampleProgress& progress, const uint8_t* data, size_t size, const TfLiteTensor* modelInput,
+				uint8_t* output);
+	// Reads a sample in the given encoding and stores it in `output`
+	int Read(const InputSource& source, const TfLiteTensor* modelInput, uint8_t encoding, uint8_t* output);
+	// Decodes a sample that was already received in full, `size` must match the encoded size
+	int Read(const uint8_t* data, size_t size, const TfLiteTensor* modelInput, uint8_t encoding, uint8_t* output);
+	// Size of a sample sent in the given encoding
+	size_t EncodedSize(const TfLiteTensor* modelInput, uint8_t encoding);
+	bool SupportsEncoding(const TfLiteTensor* modelInput, uint8_t encoding);
+	uint8_t SupportedEncodings(const TfLiteTensor* modelInput);
+
+	// Largest request header, a REQUEST_SET_PREPROCESS with the most channels
+	static constexpr size_t kMaxRequestHeaderSize = 15 + 2 * PreprocessConfig::kMaxChannels * sizeof(float);
+
+	private:
+	// Number of float32 values received and quantized at a time
+	static constexpr size_t kInputChunkSize = 64;
+
+	void DecodeQuantized(SampleProgress& progress, const uint8_t* data, size_t size, uint8_t* output);
+
+	QuantizeKernel quantize_ = nullptr;
+	float scale_ = 0.0f;
+	float inverse_scale_ = 0.0f;
+	int zero_point_ = 0;
+	float chunk_[kInputChunkSize];
+
+	// Input tensor value of every raw pixel value, as float and quantized
+	float pixel_values_[256];
+	uint8_t pixel_lut_[256];
 };
\ No newline at end of file
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/micro/micro_interpreter.h"
+
+#include "PredictionInterpreter.h"
+#include "OpProfiler.h"
+#include "pacing.h"
+#include "spsc_ring.h"
+
+struct InferenceResult {
+	uint8_t status;
+	std::vector<float> prediction;
+	long long inference_time;
+	// Output tensor the prediction was interpreted from, only valid until complete() returns
+	const TfLiteTensor* output;
+};
+
+struct InferenceJob {
+	// Request source (e.g. connection slot), sources are served round-robin
+	uint8_t source;
+	// Input tensor data to run the model on, nullptr for jobs that only need
+	// to complete in order with the other jobs of their source
+	const uint8_t* input;
+	// Called on the completion task once the job has run, the result is only valid until it returns
+	void (*complete)(const InferenceJob& job, InferenceResult& result);
+
+	// Owner data, opaque to the dispatcher
+	uint8_t type;
+	uint8_t slot;
+	uint8_t status;
+	uint8_t batch_index;
+	uint8_t batch_size;
+	uint8_t response_mode;
+	uint8_t top_k;
+	float threshold;
+	uint32_t request_id;
+	void* context;
+};
+
+// Interpreters in the pool, each with an arena of its own, one per core by default. setup() builds fewer when
+// their arenas do not fit.
+#ifndef INTERPRETER_COUNT
+#define INTERPRETER_COUNT portNUM_PROCESSORS
+#endif
+
+// Runs every inference on a pool of interpreters sharing the model and the op
+// resolver, with one inference task per interpreter. The first one runs alone on
+// the last core, further ones on the remaining cores. A completion task on core 0
+// interprets the outputs and sends the replies, next to the network I/O. Jobs are
+// handed over through lock-free rings, so receiving and preprocessing the next
+// request and replying to the previous one overlap with Invoke(). The jobs of a
+// source run on any free interpreter, concurrently, and complete in order.
+class InferenceDispatcher {
+	public:
+	// Maximum number of request sources
+	static constexpr int kMaxSources = 16;
+	static constexpr int kMaxInterpreters = 4;
+	// Jobs that can be queued per source, a power of two
+	static constexpr int kSourceQueueLength = 4;
+	// Jobs per interpreter that can wait for their completion, a power of two
+	static constexpr int kCompletionQueueLength = 4;
+	static constexpr BaseType_t kIoCore = 0;
+	static constexpr BaseType_t kInferenceCore = portNUM_PROCESSORS - 1;
+	// Core and priority of the inference task of interpreter `index`
+	static BaseType_t WorkerCore(int index) { return (kInferenceCore - index + portNUM_PROCESSORS) % portNUM_PROCESSORS; }
+	static UBaseType_t WorkerPriority(int index) {
+		// Further interpreters on the I/O core only use the time left by the network tasks
+		return (index > 0 && WorkerCore(index) == kIoCore) ? tskIDLE_PRIORITY + 1 : 5;
+	}
+
+	// Each interpreter is profiled by the profiler of the same index, which it was built with
+	int Init(tflite::MicroInterpreter* const* interpreters, OpProfiler* profilers, int interpreter_count,
+			 int source_count, int max_pending);
+	int Start();
+
+	// Queues a job of its source. Jobs with input data count towards the pending
+	// limit: when it is reached, Submit() waits for room if `wait` is set, or
+	// returns false right away so that the caller can reply with STATUS_BUSY.
+	// A full queue of the source is always waited for, see CanQueue().
+	// Each source must only be submitted to from a single task.
+	bool Submit(const InferenceJob& job, bool wait);
+	// Whether the queue of the source can take another job right away, called from the task submitting to it
+	bool CanQueue(uint8_t source) { return uxSemaphoreGetCount(space_[source]) > 0; }
+
+	private:
+	// A job that has run, along with a copy of its raw output
+	struct RanJob {
+		InferenceJob job;
+		// Position of the job among the jobs of its source, which complete in this order
+		uint32_t sequence;
+		uint8_t status;
+		long long inference_time;
+		// Copy of the output tensor, pointing to the buffer of the entry
+		TfLiteTensor output;
+	};
+
+	struct Worker {
+		InferenceDispatcher* dispatcher;
+		tflite::MicroInterpreter* interpreter;
+		OpProfiler* profiler;
+		TfLiteTensor* input;
+		TfLiteTensor* output;
+		pacing_worker_t pacing;
+		SpscRing<RanJob, kCompletionQueueLength> completions;
+		TaskHandle_t task;
+	};
+
+	static void InferenceTask(void* args);
+	static void CompletionTask(void* args);
+	uint32_t Next(InferenceJob& job);
+	void Run(Worker& worker, const InferenceJob& job, RanJob& ran);
+	RanJob* Completable(Worker*& worker);
+	void Complete(RanJob& ran);
+
+	Worker workers_[kMaxInterpreters] = {};
+	int worker_count_ = 0;
+	PredictionInterpreter prediction_interpreter_;
+	// Reused by every job, its scores are sized once by Init()
+	InferenceResult result_;
+
+	int source_count_ = 0;
+	int next_source_ = 0;
+	SpscRing<InferenceJob, kSourceQueueLength> queues_[kMaxSources];
+	// Sequence of the next job picked from every source, guarded by next_lock_ along with the consumer side
+	// of the queues, and of the next job of every source to complete, only used by the completion task
+	uint32_t picked_[kMaxSources] = {};
+	uint32_t completed_[kMaxSources] = {};
+	SemaphoreHandle_t next_lock_ = nullptr;
+	// Counts the queued jobs, every worker waiting for one is woken up by a job of its own
+	SemaphoreHandle_t queued_ = nullptr;
+	// Counts the room left for jobs with input data, and the room left in the queue of every source
+	SemaphoreHandle_t room_ = nullptr;
+	SemaphoreHandle_t space_[kMaxSources] = {};
+	TaskHandle_t completion_task_ = nullptr;
+};
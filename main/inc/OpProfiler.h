@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+
+#include "tensorflow/lite/micro/micro_profiler_interface.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+
+// Latency of an operator over the rolling window
+struct OpStats {
+	uint32_t samples;
+	uint32_t min_us;
+	uint32_t max_us;
+	float mean_us;
+	float mean_cycles;
+};
+
+// Times every operator of the main subgraph, attached to an interpreter. The
+// events of an Invoke() are numbered in execution order, which is the operator
+// order of the model, and kept over the last kWindow - 1 complete invokes.
+class OpProfiler : public tflite::MicroProfilerInterface {
+	public:
+	static constexpr int kWindow = 32;
+
+	// Reads the operators of the model, returns non-zero when it has no main subgraph
+	int Init(const tflite::Model* model);
+
+	uint32_t BeginEvent(const char* tag) override;
+	void EndEvent(uint32_t event_handle) override;
+
+	// Called by the inference task around Invoke(), only invokes that ran every operator are kept
+	void BeginInvoke();
+	void EndInvoke(bool ok);
+
+	int GetOpCount() const { return static_cast<int>(ops_.size()); }
+	// Static description of the operator as JSON members: index, op type, tensor shapes and esp-nn use
+	const std::string& GetOpInfo(int op) const { return ops_[op].info; }
+	// Latency of the operator over the window, merged into `stats` when it already holds samples
+	void GetStats(int op, OpStats& stats);
+
+	private:
+	struct Op {
+		std::string info;
+		uint32_t start_us;
+		uint32_t start_cycles;
+		uint32_t micros[kWindow];
+		uint32_t cycles[kWindow];
+	};
+
+	std::vector<Op> ops_;
+	// Event index within the current invoke
+	uint32_t next_event_ = 0;
+	// Slot of the invoke being recorded, skipped by readers
+	int position_ = 0;
+	int samples_ = 0;
+	portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+};
@@ -4,9 +4,55 @@
 #include <string>
 #include <utility>
 
-#include "tcp_server.h"
+#include "tensorflow/lite/c/common.h"
+#include "PredictionInterpreter.h"
 
+struct ModelInfo {
+	uint32_t hash;
+	uint32_t size;
+};
+
+// Layout of the inference results sent to a client, see RESPONSE_*
+struct ResponseFormat {
+	uint8_t mode;
+	uint8_t top_k;
+	float threshold;
+};
+
+// Builds the replies of the TCP requests, which the connection manager sends once the socket is writable
 class PredictionHandler {
 	public:
-	int Update(int client_socket, const std::vector<float>& predictions, long long inference_time);
-};
\ No newline at end of file
+	// Sizes the scratch storage for outputs of `score_count` scores, so that replies allocate nothing
+	void Init(size_t score_count, const TfLiteTensor* input, const TfLiteTensor* output);
+	// Capacity of a reply buffer fitting any reply, batch replies being built one sample at a time
+	size_t ReplyCapacity() const;
+	// Upper bound of the reply to a job of the given request type, or to sample `batch_index` of a batch
+	size_t MaxReplySize(uint8_t type, uint8_t batch_index) const;
+
+	// Every reply is built in `reply`, a buffer reserved with ReplyCapacity() so that it never grows
+	void BuildInfo(std::vector<uint8_t>& reply, const ModelInfo& model_info, const TfLiteTensor* input,
+				   const TfLiteTensor* output, uint8_t input_encodings);
+	void BuildStatus(std::vector<uint8_t>& reply, uint8_t status);
+	bool SupportsResponse(const ResponseFormat& format, const TfLiteTensor* output);
+	// `output` is the output tensor the predictions were interpreted from, used by RESPONSE_RAW_INT8
+	void BuildResult(std::vector<uint8_t>& reply, const ResponseFormat& format, const std::vector<float>& predictions,
+					 const TfLiteTensor* output, long long inference_time);
+	void BuildTagged(std::vector<uint8_t>& reply, uint32_t request_id, uint8_t status, const ResponseFormat& format,
+					 const std::vector<float>& predictions, const TfLiteTensor* output, long long inference_time);
+	// Batch replies are built one sample at a time, the first sample is preceded by the header of the batch
+	void BuildBatchSample(std::vector<uint8_t>& reply, uint8_t sample_index, uint8_t sample_count,
+						  const std::vector<float>& predictions, long long inference_time);
+
+	private:
+	void AppendTensorInfo(std::vector<uint8_t>& reply, const TfLiteTensor* tensor);
+	void AppendResult(std::vector<uint8_t>& reply, const ResponseFormat& format, const std::vector<float>& predictions,
+					  const TfLiteTensor* output, long long inference_time);
+
+	PredictionInterpreter prediction_interpreter_;
+	std::vector<LabelScore> sparse_;
+	std::vector<uint16_t> labels_;
+	size_t score_count_ = 0;
+	// Largest result of an inference in any response mode
+	size_t result_size_ = 0;
+	size_t info_size_ = 0;
+};
@@ -4,11 +4,30 @@
 #include <string>
 #include "tensorflow/lite/c/common.h"
 
+#include "quantization.h"
+
+// Entry of a sparse result, the label is the index of the score in the output tensor
+struct LabelScore {
+	uint16_t label;
+	float score;
+};
+
 class PredictionInterpreter {
 public:
-	std::vector<float> GetResult(const TfLiteTensor* output_tensor, float threshold);
+	// Resolves the dequantize kernel of the output tensor once, returns non-zero when it is not supported
+	int Init(const TfLiteTensor* output_tensor);
+	// Every score of the output tensor, indexed by label. `results` is resized, so it
+	// only allocates when it was not reserved for GetScoreCount() scores. Requires Init().
+	void GetResult(const TfLiteTensor* output_tensor, std::vector<float>& results);
+	size_t GetScoreCount(const TfLiteTensor* output_tensor);
+	// Keeps the scores at or above the threshold in label order, `results` is reused between calls
+	void GetSparseResult(const std::vector<float>& scores, float threshold, std::vector<LabelScore>& results);
 
 private:
 	size_t GetTypeSize(TfLiteType type);
-	void Dequantize(const TfLiteTensor* output_tensor, std::vector<float>& results);
+
+	DequantizeKernel dequantize_ = nullptr;
+	size_t score_count_ = 0;
+	float scale_ = 0.0f;
+	int zero_point_ = 0;
 };
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "tensorflow/lite/c/common.h"
+
+#include "quantization.h"
+
+// Resize modes of the preprocessing stage
+#define RESIZE_NEAREST	0x00
+#define RESIZE_BILINEAR	0x01
+
+// Frames sent by the client, and how they map to the input tensor
+struct PreprocessConfig {
+	static constexpr int kMaxChannels = 4;
+
+	uint16_t frame_width;
+	uint16_t frame_height;
+	uint8_t channels;
+	// Region of the frame fed to the model, a zero width or height selects the whole frame
+	uint16_t crop_x;
+	uint16_t crop_y;
+	uint16_t crop_width;
+	uint16_t crop_height;
+	uint8_t resize_mode;
+	// Per channel normalization, applied as (pixel / 255 - mean) / std
+	float mean[kMaxChannels];
+	float std[kMaxChannels];
+};
+
+// Turns raw uint8 HWC frames into the input tensor while they are received.
+// Only two frame rows are kept in memory: cropping and resizing run on integer
+// source positions and Q8 weights, and the normalization and quantization of
+// every channel collapse into a lookup table.
+class Preprocessor {
+	public:
+	// Largest frame row kept in memory
+	static constexpr size_t kMaxRowSize = 4096;
+
+	// Whether frames can be preprocessed into the input tensor at all: it needs spatial
+	// dimensions and a float or quantized type
+	static bool Supports(const TfLiteTensor* modelInput);
+	// Validates the configuration against the input tensor (NHWC) and builds the mapping tables.
+	// A rejected configuration leaves the previous one in use, along with its tables and buffers.
+	int Configure(const PreprocessConfig& config, const TfLiteTensor* modelInput);
+	bool IsConfigured() const { return configured_; }
+	// Size of a frame on the wire
+	size_t FrameSize() const;
+	// Starts receiving a frame
+	void Begin();
+	// Consumes the next `size` bytes of the frame, at most the rest of it, and writes the input
+	// tensor rows they complete to `output` (modelInput->bytes long)
+	void Feed(const uint8_t* data, size_t size, uint8_t* output);
+
+	private:
+	// Source position of an output row or column: the two neighbouring pixels and the Q8 weight of the second one
+	struct Tap {
+		uint16_t first;
+		uint16_t second;
+		uint8_t weight;
+	};
+
+	void BuildTaps(std::vector<Tap>& taps, int output_size, int crop_offset, int crop_size);
+	void EmitRow(int output_row, const uint8_t* first, const uint8_t* second, uint8_t weight, uint8_t* output);
+	void EndRow(uint8_t* output);
+
+	PreprocessConfig config_ = {};
+	bool configured_ = false;
+	bool float_output_ = false;
+	int output_width_ = 0;
+	int output_height_ = 0;
+
+	std::vector<Tap> columns_;
+	std::vector<Tap> rows_;
+	// Two frame rows, indexed by the parity of the row
+	std::vector<uint8_t> row_buffer_;
+	// Frame row being received, how much of it has arrived, and the next output row
+	int row_ = 0;
+	size_t row_offset_ = 0;
+	int output_row_ = 0;
+	// Input tensor value of every pixel value of every channel
+	std::vector<float> values_;
+	std::vector<uint8_t> lut_;
+};
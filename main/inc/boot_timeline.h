@@ -0,0 +1,54 @@
+#ifndef BOOT_TIMELINE_H
+#define BOOT_TIMELINE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Startup phases, in boot order. The numbering is part of the handshake, new phases go last.
+typedef enum {
+	BOOT_PHASE_NVS_INIT,
+	BOOT_PHASE_CONNECT_WIFI,
+	BOOT_PHASE_AKRI_SERVER_START,
+	BOOT_PHASE_GET_MODEL,		// loading the model (mapping its partition) and tflite::GetModel()
+	BOOT_PHASE_ARENA_ALLOCATION,	// sizing (calibrating) and allocating the tensor arenas
+	BOOT_PHASE_ALLOCATE_TENSORS,
+	BOOT_PHASE_WARMUP,		// ends when the model is ready
+	BOOT_PHASE_COUNT
+} boot_phase_t;
+
+typedef struct {
+	uint32_t start_us;	// since the start of the application, 0 when the phase was not reached
+	uint32_t duration_us;	// summed over the runs of the phase, e.g. one per interpreter
+} boot_phase_time_t;
+
+typedef struct {
+	char firmware_version[16];
+	uint32_t reset_reason;	// esp_reset_reason_t of the reset that started the boot
+	boot_phase_time_t phases[BOOT_PHASE_COUNT];
+} boot_timeline_t;
+
+// Called first thing in app_main(): the timeline of the previous boot, kept in RTC
+// memory across soft resets (esp_restart(), OTA, panics, watchdogs), is set aside
+// and the timeline of this boot starts. A power-on reset clears both.
+void boot_timeline_init(void);
+
+void boot_phase_begin(boot_phase_t phase);
+void boot_phase_end(boot_phase_t phase);
+
+const char *boot_phase_name(boot_phase_t phase);
+
+// Boots since the last power-on reset, this one included
+uint32_t boot_timeline_count(void);
+
+// Copies the timeline of this boot and, when there is one, of the previous boot.
+// Returns non-zero when `previous` is not set because this boot followed a power-on reset.
+int boot_timeline_get(boot_timeline_t *current, boot_timeline_t *previous);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BOOT_TIMELINE_H
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "tensorflow/lite/c/common.h"
+
+// Held while an esp-nn kernel that uses the scratch buffer of esp-nn runs, created on first use
+SemaphoreHandle_t esp_nn_scratch_lock();
+
+// esp-nn keeps the scratch buffer of its conv, depthwise conv and softmax kernels in a file-static pointer, which
+// the kernel of an interpreter sets right before it runs. With interpreters invoked on several cores, those kernels
+// run one at a time across the interpreters, the other operators still run concurrently. `Op` tells the guarded
+// kernels apart, e.g. tflite::BuiltinOperator_CONV_2D.
+template <int Op>
+class EspNnScratchGuard {
+	public:
+	template <typename Registration>
+	static Registration Wrap(Registration registration) {
+		invoke_ = registration.invoke;
+		registration.invoke = Invoke;
+		esp_nn_scratch_lock();
+		return registration;
+	}
+
+	private:
+	static TfLiteStatus Invoke(TfLiteContext* context, TfLiteNode* node) {
+		// Only int8 inputs run an esp-nn kernel, the reference kernels keep no global state
+		const TfLiteEvalTensor* input = context->GetEvalTensor(context, node->inputs->data[0]);
+		if (input->type != kTfLiteInt8) {
+			return invoke_(context, node);
+		}
+
+		SemaphoreHandle_t lock = esp_nn_scratch_lock();
+		xSemaphoreTake(lock, portMAX_DELAY);
+		TfLiteStatus status = invoke_(context, node);
+		xSemaphoreGive(lock);
+		return status;
+	}
+
+	static inline TfLiteStatus (*invoke_)(TfLiteContext* context, TfLiteNode* node) = nullptr;
+};
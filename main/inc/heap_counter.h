@@ -0,0 +1,26 @@
+#ifndef HEAP_COUNTER_H
+#define HEAP_COUNTER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tasks whose heap allocations can be counted: the inference tasks of a full pool, the completion task and the tasks
+// of the TCP, UDP and HTTP servers
+#define HEAP_COUNTER_MAX_TASKS 8
+
+// Counts the heap allocations of the calling task from now on: every allocation of the heap component (malloc(),
+// heap_caps_*(), operator new) with CONFIG_HEAP_USE_HOOKS, which the build enables, or only the C++ ones
+// (operator new) without it. Returns non-zero when HEAP_COUNTER_MAX_TASKS tasks are counted already.
+int heap_counter_track_task(void);
+
+// Number of heap allocations made by the calling task since it is counted, 0 for other tasks
+uint32_t heap_allocation_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HEAP_COUNTER_H
@@ -9,6 +9,13 @@ extern "C" {
 
 esp_err_t info_get_handler(httpd_req_t *req);
 esp_err_t temp_get_handler(httpd_req_t *req);
+esp_err_t pacing_get_handler(httpd_req_t *req);
+esp_err_t pacing_post_handler(httpd_req_t *req);
+esp_err_t boot_get_handler(httpd_req_t *req);
+
+// Defined next to the inference dispatcher, registered once setup() is done
+esp_err_t infer_post_handler(httpd_req_t *req);
+esp_err_t profile_get_handler(httpd_req_t *req);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,72 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Default pacing configuration
+#define PACING_DEFAULT_CONNECTION_RATE	0.0f	// requests/sec per connection, 0 = unlimited
+#define PACING_DEFAULT_CONNECTION_BURST	10.0f	// requests
+#define PACING_DEFAULT_MAX_DUTY_CYCLE	0.9f	// fraction of CPU time spent in Invoke(), per inference task
+#define PACING_DEFAULT_THROTTLE_TEMP	70.0f	// °C, duty cycle starts scaling down
+#define PACING_DEFAULT_CRITICAL_TEMP	85.0f	// °C, duty cycle reaches its minimum
+#define PACING_DEFAULT_MIN_DUTY_CYCLE	0.2f
+#define PACING_DEFAULT_YIELD_INTERVAL	1000	// ms of busy time before yielding to the idle task
+
+typedef struct {
+	float connection_rate;
+	float connection_burst;
+	float max_duty_cycle;
+	float min_duty_cycle;
+	float throttle_temp;
+	float critical_temp;
+	uint32_t yield_interval_ms;
+} pacing_config_t;
+
+typedef struct {
+	float tokens;
+	int64_t last_update;	// us
+} token_bucket_t;
+
+// Per connection pacing state
+typedef struct {
+	token_bucket_t bucket;
+} pacing_connection_t;
+
+// Per inference task pacing state
+typedef struct {
+	int64_t last_yield;	// us
+} pacing_worker_t;
+
+void pacing_init(void);
+void pacing_get_config(pacing_config_t *config);
+int pacing_set_config(const pacing_config_t *config);
+
+// Last measured chip temperature and the resulting global duty cycle
+float pacing_get_temperature(void);
+float pacing_get_duty_cycle(void);
+
+void pacing_connection_init(pacing_connection_t *conn);
+
+// Returns the time (us) until the connection may issue its next request, 0 when it may right away
+int64_t pacing_connection_delay(pacing_connection_t *conn);
+
+// Charges a request of `samples` inferences to the connection, its bucket may be overdrawn
+void pacing_connection_charge(pacing_connection_t *conn, int samples);
+
+void pacing_worker_init(pacing_worker_t *worker);
+
+// Blocks the calling inference task until the global compute budget allows the next Invoke()
+void pacing_wait_compute(pacing_worker_t *worker);
+
+// Charges the measured Invoke() time against the global compute budget
+void pacing_account(int64_t invoke_time_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PACING_H
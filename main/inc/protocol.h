@@ -0,0 +1,136 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Request opcodes, sent by the client as the first byte of every request.
+//
+// REQUEST_INFER:       [0x01][input tensor]
+//                      -> [scores (float32 x N)][inference time (int64, us)]
+// REQUEST_INFER_BATCH: [0x02][count (uint8)][input tensor x count]
+//                      -> [count (uint8)][scores per sample (uint16)]
+//                         [scores (float32 x N)][inference time (int64, us)] x count
+//                      The result of every sample is sent as soon as it completes,
+//                      the client may read them while later samples still run.
+// REQUEST_SET_ENCODING: [0x03][input encoding (uint8)] -> [status (uint8)]
+//                      Selects the encoding of the input tensors sent on this
+//                      connection from now on.
+// REQUEST_INFO:        [0x04]
+//                      -> [protocol version (uint8)][supported input encodings (uint8 bitmask)]
+//                         [model hash (uint32)][model size (uint32)]
+//                         [name length (uint8)][name][version length (uint8)][version]
+//                         [input tensor descriptor][output tensor descriptor]
+//                         [boot phase count (uint8)][start (uint32, us)][duration (uint32, us)] x count
+//                      tensor descriptor: [TfLiteType (uint8)][dims count (uint8)]
+//                         [dims (int32 x count)][scale (float32)][zero point (int32)]
+//                      The boot phases are the startup timeline of the device, see boot_phase_t.
+//                      Phases that were not reached (yet) have a zero start.
+// REQUEST_INFER_TAGGED: [0x05][request id (uint32)][input tensor]
+//                      -> [request id (uint32)][status (uint8)][payload length (uint16)][payload]
+//                      payload: [scores (float32 x N)][inference time (int64, us)]
+//                      The scores and inference time are replaced by the selected
+//                      response mode, see REQUEST_SET_RESPONSE.
+//                      Tagged requests can be pipelined, the client does not need to
+//                      wait for a reply before sending the next request. When the
+//                      inference queue of the device is full, the request is dropped
+//                      and answered right away with STATUS_BUSY and no payload.
+//                      Requests that arrive while the device warms the model up after
+//                      boot are answered with STATUS_WARMING_UP and no payload, while
+//                      REQUEST_INFER and REQUEST_INFER_BATCH wait for the model.
+// REQUEST_SET_RESPONSE: [0x06][response mode (uint8)][k (uint8)][threshold (float32)]
+//                      -> [status (uint8)]
+//                      Selects the layout of the REQUEST_INFER and REQUEST_INFER_TAGGED
+//                      results sent on this connection from now on, k is only used by
+//                      RESPONSE_TOP_K and the threshold by RESPONSE_SPARSE. Batch
+//                      replies always carry the full scores.
+// REQUEST_SET_PREPROCESS: [0x07][frame width (uint16)][frame height (uint16)][channels (uint8)]
+//                      [crop x (uint16)][crop y (uint16)][crop width (uint16)][crop height (uint16)]
+//                      [resize mode (uint8)][mean (float32 x channels)][std (float32 x channels)]
+//                      -> [status (uint8)]
+//                      Switches the connection to INPUT_ENCODING_FRAME_UINT8: samples are raw
+//                      uint8 frames (row-major, interleaved channels) that the device crops,
+//                      resizes (RESIZE_NEAREST or RESIZE_BILINEAR) and normalizes as
+//                      (pixel / 255 - mean) / std into the input tensor. A zero crop width or
+//                      height selects the whole frame. Configurations that do not fit the input
+//                      tensor are answered with STATUS_UNSUPPORTED and leave the encoding, and a
+//                      configuration accepted before, as they were.
+//
+// UDP datagrams, when the firmware is built with a UDP port:
+//   request: [request id (uint32)][input encoding (uint8)][input tensor]
+//   reply:   [request id (uint32)][status (uint8)][scores (float32 x N)][inference time (int64, us)]
+//   The scores and inference time are only sent with STATUS_OK. Malformed datagrams and
+//   requests with an unsupported encoding are dropped without a reply, a full inference
+//   queue is answered with STATUS_BUSY and a model still warming up with STATUS_WARMING_UP.
+//   Nothing is retransmitted, clients time out and resend on their own.
+//
+// All multi-byte values are little-endian.
+#define REQUEST_INFER		0x01
+#define REQUEST_INFER_BATCH	0x02
+#define REQUEST_SET_ENCODING	0x03
+#define REQUEST_INFO		0x04
+#define REQUEST_INFER_TAGGED	0x05
+#define REQUEST_SET_RESPONSE	0x06
+#define REQUEST_SET_PREPROCESS	0x07
+
+// Version 2 adds REQUEST_SET_RESPONSE and the payload length of tagged replies, 3 the
+// threshold of REQUEST_SET_RESPONSE and 4 the boot timeline of the REQUEST_INFO reply
+#define PROTOCOL_VERSION	4
+
+// Header sizes of UDP requests and replies
+#define UDP_REQUEST_HEADER_SIZE		5
+#define UDP_REPLY_HEADER_SIZE		5
+
+// Upper bound for the number of samples in a single batch request
+#define MAX_BATCH_SIZE		32
+
+// Input encodings
+// FLOAT32:     float32 values, quantized on the device for quantized models (default)
+// QUANT_INT8:  already quantized int8 values, received straight into an int8 input tensor
+// QUANT_UINT8: already quantized uint8 values, received straight into a uint8 input
+//              tensor, or shifted by 128 in place for an int8 input tensor
+// PIXEL_UINT8: raw 8-bit pixels, normalized as (pixel / 255 - PIXEL_MEAN) / PIXEL_STD
+//              and converted to the input tensor type with a lookup table
+// FRAME_UINT8: raw 8-bit frames of the size set by REQUEST_SET_PREPROCESS, which is
+//              the only way to select this encoding
+#define INPUT_ENCODING_FLOAT32		0x00
+#define INPUT_ENCODING_QUANT_INT8	0x01
+#define INPUT_ENCODING_QUANT_UINT8	0x02
+#define INPUT_ENCODING_PIXEL_UINT8	0x03
+#define INPUT_ENCODING_FRAME_UINT8	0x04
+
+// Number of input encodings, bit n of the handshake bitmask is set when encoding n is supported
+#define INPUT_ENCODING_COUNT		5
+
+// Response modes
+// FULL:     [scores (float32 x N)][inference time (int64, us)] (default)
+// ARGMAX:   [label (uint16)]
+// TOP_K:    [count (uint8)][label (uint16)][score (float32)] x count, highest score first
+// RAW_INT8: [scale (float32)][zero point (int32)][scores (int8 x N)], int8 output tensors only
+// SPARSE:   [count (uint16)][label (uint16)][score (float32)] x count, the scores at or above
+//           the threshold in label order
+// RESPONSE_WITH_TIME or-ed into a compact mode appends [inference time (int64, us)]
+#define RESPONSE_FULL		0x00
+#define RESPONSE_ARGMAX		0x01
+#define RESPONSE_TOP_K		0x02
+#define RESPONSE_RAW_INT8	0x03
+#define RESPONSE_SPARSE		0x04
+#define RESPONSE_MODE_COUNT	5
+
+#define RESPONSE_WITH_TIME	0x80
+
+// Status codes
+#define STATUS_OK		0x00
+#define STATUS_UNSUPPORTED	0x01
+#define STATUS_ERROR		0x02
+#define STATUS_BUSY		0x03
+#define STATUS_WARMING_UP	0x04
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROTOCOL_H
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// Only the kernel lookups need the tensor, the kernels themselves build without TFLite (host tests)
+struct TfLiteTensor;
+
+// Converts `count` raw tensor values to float
+using DequantizeKernel = void (*)(const void* input, float* output, size_t count, float scale, int zero_point);
+// Converts `count` float values to the raw values of a quantized tensor,
+// `inverse_scale` is 1 / scale so that no element needs a divide
+using QuantizeKernel = void (*)(const float* input, void* output, size_t count, float scale, float inverse_scale,
+								int zero_point);
+
+// Rounds half away from zero like std::round, exact for |value| < 2^22. The float unit
+// rounds half to even, the ties it rounded towards zero are moved one step away.
+// Relies on strict float semantics, it must not be built with -ffast-math.
+inline float RoundHalfAway(float value) {
+	constexpr float kMagic = 12582912.0f;  // 1.5 * 2^23
+	float rounded = (value + kMagic) - kMagic;
+	float remainder = value - rounded;
+	return rounded + static_cast<float>(remainder == 0.5f && value > 0.0f) -
+		   static_cast<float>(remainder == -0.5f && value < 0.0f);
+}
+
+// One instantiation per tensor type and quantization mode, so that the
+// inner loops carry no per element branches
+template <typename T, bool Quantized>
+void DequantizeValues(const void* input, float* output, size_t count, float scale, int zero_point) {
+	const T* values = static_cast<const T*>(input);
+	for (size_t i = 0; i < count; i++) {
+		if constexpr (Quantized) {
+			output[i] = (static_cast<int>(values[i]) - zero_point) * scale;
+		} else {
+			output[i] = static_cast<float>(values[i]);
+		}
+	}
+}
+
+// Bit-exact with clamp(std::round(input / scale) + zero_point), without a divide: the
+// product by the reciprocal is within two units of the quotient, and one fused
+// correction step (Markstein) turns it into the correctly rounded quotient.
+// Saturates in the float domain before converting, so that the loop is
+// straight-line code: vectorized on the host, and free of branches on the
+// scalar float unit of the ESP32 targets. NaN inputs map to the lower bound.
+template <typename T>
+void QuantizeValues(const float* input, void* output, size_t count, float scale, float inverse_scale,
+					int zero_point) {
+	constexpr float kMin = std::numeric_limits<T>::min();
+	constexpr float kMax = std::numeric_limits<T>::max();
+	const float offset = zero_point;
+	// Inputs this far out saturate anyway, bounding them keeps the quotient exact and finite
+	const float limit = 1048576.0f * scale;  // 2^20 steps
+
+	T* values = static_cast<T*>(output);
+	for (size_t i = 0; i < count; i++) {
+		// Compared rather than fmax(), which lets signaling NaNs through
+		float value = input[i] > -limit ? input[i] : -limit;
+		value = value < limit ? value : limit;
+		float quotient = value * inverse_scale;
+		quotient = std::fma(std::fma(-quotient, scale, value), inverse_scale, quotient);
+		value = std::fmin(std::fmax(RoundHalfAway(quotient) + offset, kMin), kMax);
+		values[i] = static_cast<T>(static_cast<int>(value));
+	}
+}
+
+// Resolve the kernel of a tensor once, nullptr when its type is not supported
+DequantizeKernel GetDequantizeKernel(const TfLiteTensor* tensor);
+// Only 8-bit quantized tensors are supported
+QuantizeKernel GetQuantizeKernel(const TfLiteTensor* tensor);
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+// Lock-free ring of N entries (a power of two) between exactly one producer
+// task and one consumer task. Entries are filled and drained in place.
+template <typename T, size_t N>
+class SpscRing {
+	static_assert(N && (N & (N - 1)) == 0, "The ring size must be a power of two");
+
+	public:
+	// Producer side: the entry to fill, nullptr while the ring is full
+	T* Reserve() {
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head - tail_.load(std::memory_order_acquire) == N) {
+			return nullptr;
+		}
+		return &entries_[head & (N - 1)];
+	}
+	// Makes the reserved entry visible to the consumer
+	void Publish() {
+		head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Consumer side: the oldest entry, nullptr while the ring is empty
+	T* Peek() {
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail == head_.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		return &entries_[tail & (N - 1)];
+	}
+	// Hands the peeked entry back to the producer
+	void Release() {
+		tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool Push(const T& value) {
+		T* entry = Reserve();
+		if (!entry) {
+			return false;
+		}
+		*entry = value;
+		Publish();
+		return true;
+	}
+
+	bool Pop(T& value) {
+		T* entry = Peek();
+		if (!entry) {
+			return false;
+		}
+		value = *entry;
+		Release();
+		return true;
+	}
+
+	// Producer side only, the entries are owned by the ring
+	T& operator[](size_t index) { return entries_[index]; }
+
+	private:
+	T entries_[N];
+	std::atomic<size_t> head_{0};
+	std::atomic<size_t> tail_{0};
+};
+
+// Lock-free byte stream between exactly one producer task and one consumer task,
+// over a buffer of a power of two size allocated once
+class SpscByteRing {
+	public:
+	// Allocates the buffer, `capacity` is rounded up to a power of two
+	bool Init(size_t capacity) {
+		size_t size = 1;
+		while (size < capacity) {
+			size <<= 1;
+		}
+		buffer_ = new (std::nothrow) uint8_t[size];
+		mask_ = size - 1;
+		return buffer_ != nullptr;
+	}
+	size_t Capacity() const { return mask_ + 1; }
+
+	// Producer side: free space, and appending at most that much, nothing is written when `size` does not fit
+	size_t Free() const {
+		return Capacity() - (head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_acquire));
+	}
+	bool Write(const void* data, size_t size) {
+		if (size > Free()) {
+			return false;
+		}
+		size_t head = head_.load(std::memory_order_relaxed);
+		size_t offset = head & mask_;
+		size_t first = size < Capacity() - offset ? size : Capacity() - offset;
+		memcpy(buffer_ + offset, data, first);
+		memcpy(buffer_, static_cast<const uint8_t*>(data) + first, size - first);
+		head_.store(head + size, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side: the oldest bytes that are contiguous in the buffer, returns their count
+	size_t Peek(const uint8_t** data) const {
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		size_t used = head_.load(std::memory_order_acquire) - tail;
+		size_t offset = tail & mask_;
+		*data = buffer_ + offset;
+		return used < Capacity() - offset ? used : Capacity() - offset;
+	}
+	// Hands the `size` oldest bytes back to the producer
+	void Consume(size_t size) {
+		tail_.store(tail_.load(std::memory_order_relaxed) + size, std::memory_order_release);
+	}
+	bool Empty() const {
+		return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed);
+	}
+
+	// Drops every byte, while neither side is using the ring
+	void Reset() {
+		head_.store(0, std::memory_order_relaxed);
+		tail_.store(0, std::memory_order_relaxed);
+	}
+
+	private:
+	uint8_t* buffer_ = nullptr;
+	size_t mask_ = 0;
+	std::atomic<size_t> head_{0};
+	std::atomic<size_t> tail_{0};
+};
@@ -15,16 +15,57 @@ extern "C" {
 
 #define PORT 1234
 
+// Upper bound of concurrently served connections, further clients wait in the listen backlog
+#ifndef MAX_CONNECTIONS
+#define MAX_CONNECTIONS 4
+#endif
+
+// A request that has started arriving must keep arriving, a connection it stalls on for
+// this long is closed (checked at this interval at least while connections are open)
+#define TCP_IO_TIMEOUT_MS 5000
+// Select timeout used while any connection is throttled by its handler
+#define TCP_SERVER_POLL_INTERVAL_MS 10
+
+// Connection callbacks, all of them are called from the task running tcp_server_run()
+typedef struct {
+	// A client was accepted in slot `id`, returns non-zero to reject it
+	int (*on_open)(int id, int client_socket);
+	// The socket of slot `id` is readable, returns non-zero to close the connection.
+	// It must not block: it reads what tcp_server_read() returns and keeps its own state.
+	int (*on_readable)(int id, int client_socket);
+	// Called before every wait for events, returns zero to stop reading from slot `id`
+	// for now and a negative value to close the connection
+	int (*wants_read)(int id);
+	// Called before every wait for events, returns non-zero while slot `id` has replies to send
+	int (*wants_write)(int id);
+	// The socket of slot `id` is writable, returns non-zero to close the connection.
+	// It must not block either: it sends what tcp_server_write() accepts and keeps the rest.
+	int (*on_writable)(int id, int client_socket);
+	// The connection of slot `id` is about to be closed
+	void (*on_close)(int id, int client_socket);
+} tcp_server_handlers_t;
+
 typedef struct {
 	int server_fd;
 	struct sockaddr_in address;
 	int addrlen;
+	// Client sockets, -1 for free slots
+	int connections[MAX_CONNECTIONS];
+	// Readable after tcp_server_wake(), so that other tasks can end the wait for events
+	int wake_fd;
 } tcp_server_t;
 
 int tcp_server_init(tcp_server_t *server);
-int tcp_server_accept(tcp_server_t *server);
-ssize_t tcp_server_receive(int client_socket, void *buffer, size_t buffer_size);
-ssize_t tcp_server_send(int client_socket, const void *buffer, size_t buffer_size);
+void tcp_server_run(tcp_server_t *server, const tcp_server_handlers_t *handlers);
+// Reads what the socket has buffered, up to `buffer_size` bytes, without waiting for more.
+// Returns the number of bytes read, 0 when nothing is buffered, and -1 on errors and once
+// the client has closed the connection.
+ssize_t tcp_server_read(int client_socket, void *buffer, size_t buffer_size);
+// Sends what the socket has room for, up to `buffer_size` bytes, without waiting for more room.
+// Returns the number of bytes sent, 0 when the send buffer is full, and -1 on errors.
+ssize_t tcp_server_write(int client_socket, const void *buffer, size_t buffer_size);
+// Makes tcp_server_run() call the handlers again, e.g. once replies were queued. Safe from any task.
+void tcp_server_wake(tcp_server_t *server);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,32 @@
+#ifndef UDP_SERVER_H
+#define UDP_SERVER_H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	int server_fd;
+	struct sockaddr_in address;
+} udp_server_t;
+
+int udp_server_init(udp_server_t *server, uint16_t port);
+
+// Receives a single datagram, `from` is set to the address of its sender.
+// Returns the datagram size, larger datagrams than `buffer_size` are truncated.
+ssize_t udp_server_receive(udp_server_t *server, void *buffer, size_t buffer_size, struct sockaddr_in *from);
+
+// Sends a single datagram, it is dropped silently by the network if it gets lost
+ssize_t udp_server_send(udp_server_t *server, const void *buffer, size_t buffer_size, const struct sockaddr_in *to);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // UDP_SERVER_H
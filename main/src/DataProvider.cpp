@@ -2,57 +2,275 @@
 
 #include <esp_log.h>
 
-#include <vector>
-#include <string>
-#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
 static const char *TAG = "tcp_server";
 
-int DataProvider::Read(int client_socket, TfLiteTensor* modelInput) {
-	char request_byte = 0x00;
+void DataProvider::Init(const TfLiteTensor* modelInput) {
+	quantize_ = GetQuantizeKernel(modelInput);
+	if (quantize_) {
+		scale_ = modelInput->params.scale;
+		inverse_scale_ = 1.0f / scale_;
+		zero_point_ = modelInput->params.zero_point;
+	}
 
-	// Read the request byte
-	int err = tcp_server_receive(client_socket, &request_byte, 1);
-	if (err <= 0) {
-		ESP_LOGE(TAG, "Error occurred during receiving request byte: errno %d", errno);
-		return 1;
+	// Normalization and quantization of a pixel collapse into a single table lookup
+	for (int pixel = 0; pixel < 256; pixel++) {
+		pixel_values_[pixel] = (pixel / 255.0f - PIXEL_MEAN) / PIXEL_STD;
+	}
+	if (quantize_) {
+		quantize_(pixel_values_, pixel_lut_, 256, scale_, inverse_scale_, zero_point_);
 	}
+}
 
-	// Check the request byte
-	if (request_byte != 0x01) {
-		ESP_LOGE(TAG, "Invalid request byte: %d", request_byte);
+int DataProvider::ParseRequest(const uint8_t* header, size_t size, Request& request) {
+	if (size == 0) {
 		return 1;
 	}
 
+	request.type = header[0];
+	request.sample_count = 1;
+	request.input_encoding = INPUT_ENCODING_FLOAT32;
+	request.skip = 0;
 
-	if (modelInput->type == kTfLiteInt8) {
-		float scale = modelInput->params.scale;
-		int zero_point = modelInput->params.zero_point;
-		int8_t* input_data = modelInput->data.int8;
+	// Size of the header, the request byte included
+	size_t header_size = 1;
+	switch (request.type) {
+		case REQUEST_INFER:
+			break;
+		case REQUEST_INFO:
+			request.sample_count = 0;
+			break;
+		case REQUEST_INFER_TAGGED:
+			// The request id follows the request byte
+			header_size += sizeof(request.request_id);
+			break;
+		case REQUEST_INFER_BATCH:
+			// The batch size follows the request byte
+			header_size += 1;
+			break;
+		case REQUEST_SET_ENCODING:
+			request.sample_count = 0;
+			header_size += 1;
+			break;
+		case REQUEST_SET_RESPONSE:
+			request.sample_count = 0;
+			header_size += 2 + sizeof(float);
+			break;
+		case REQUEST_SET_PREPROCESS:
+			// The size of the normalization depends on the channel count of the fixed part
+			request.sample_count = 0;
+			header_size += 14;
+			if (size >= header_size) {
+				uint8_t channels = header[5];
+				size_t normalization = 2 * channels * sizeof(float);
+				if (channels == 0 || channels > PreprocessConfig::kMaxChannels) {
+					request.skip = normalization;
+				} else {
+					header_size += normalization;
+				}
+			}
+			break;
+		default:
+			ESP_LOGE(TAG, "Invalid request byte: %d", request.type);
+			return -1;
+	}
 
-		// Read the image data
-		std::vector<float> input_data_vec(modelInput->bytes * sizeof(float));
-		err = tcp_server_receive(client_socket, input_data_vec.data(), modelInput->bytes * sizeof(float));
-		if (err <= 0) {
-			ESP_LOGE(TAG, "Error occurred during receiving image: errno %d", errno);
-			return 1;
+	if (size < header_size) {
+		return header_size - size;
+	}
+
+	switch (request.type) {
+		case REQUEST_INFER_TAGGED:
+			memcpy(&request.request_id, header + 1, sizeof(request.request_id));
+			break;
+		case REQUEST_INFER_BATCH:
+			request.sample_count = header[1];
+			if (request.sample_count == 0 || request.sample_count > MAX_BATCH_SIZE) {
+				ESP_LOGE(TAG, "Invalid batch size: %d (max %d)", request.sample_count, MAX_BATCH_SIZE);
+				return -1;
+			}
+			break;
+		case REQUEST_SET_ENCODING:
+			request.input_encoding = header[1];
+			break;
+		case REQUEST_SET_RESPONSE:
+			request.response_mode = header[1];
+			request.top_k = header[2];
+			memcpy(&request.threshold, header + 3, sizeof(float));
+			break;
+		case REQUEST_SET_PREPROCESS: {
+			PreprocessConfig& config = request.preprocess;
+			memcpy(&config.frame_width, header + 1, sizeof(uint16_t));
+			memcpy(&config.frame_height, header + 3, sizeof(uint16_t));
+			config.channels = header[5];
+			memcpy(&config.crop_x, header + 6, sizeof(uint16_t));
+			memcpy(&config.crop_y, header + 8, sizeof(uint16_t));
+			memcpy(&config.crop_width, header + 10, sizeof(uint16_t));
+			memcpy(&config.crop_height, header + 12, sizeof(uint16_t));
+			config.resize_mode = header[14];
+
+			// The normalization is skipped so that the connection stays in sync,
+			// Preprocessor::Configure() then rejects the channel count
+			if (request.skip) {
+				ESP_LOGE(TAG, "Invalid channel count: %d (max %d)", config.channels, PreprocessConfig::kMaxChannels);
+				break;
+			}
+			memcpy(config.mean, header + 15, config.channels * sizeof(float));
+			memcpy(config.std, header + 15 + config.channels * sizeof(float), config.channels * sizeof(float));
+			break;
 		}
+		default:
+			break;
+	}
 
-		// Convert float to int8
-		for (size_t i = 0; i < input_data_vec.size(); i++) {
-			input_data[i] = static_cast<int8_t>((input_data_vec[i] / scale) + zero_point);
+	return 0;
+}
+
+bool DataProvider::SupportsEncoding(const TfLiteTensor* modelInput, uint8_t encoding) {
+	switch (encoding) {
+		case INPUT_ENCODING_FLOAT32:
+			return modelInput->type == kTfLiteFloat32 || GetQuantizeKernel(modelInput);
+		case INPUT_ENCODING_QUANT_INT8:
+			return modelInput->type == kTfLiteInt8;
+		case INPUT_ENCODING_QUANT_UINT8:
+			return modelInput->type == kTfLiteInt8 || modelInput->type == kTfLiteUInt8;
+		case INPUT_ENCODING_PIXEL_UINT8:
+			return modelInput->type == kTfLiteFloat32 || GetQuantizeKernel(modelInput);
+		default:
+			return false;
+	}
+}
+
+uint8_t DataProvider::SupportedEncodings(const TfLiteTensor* modelInput) {
+	uint8_t encodings = 0;
+	for (uint8_t encoding = 0; encoding < INPUT_ENCODING_COUNT; encoding++) {
+		if (SupportsEncoding(modelInput, encoding)) {
+			encodings |= 1 << encoding;
 		}
-	} else if (modelInput->type == kTfLiteFloat32) {
-		// Read the image data
-		err = tcp_server_receive(client_socket, modelInput->data.raw, modelInput->bytes);
-		if (err <= 0) {
+	}
+	// Frames are selected by REQUEST_SET_PREPROCESS rather than REQUEST_SET_ENCODING,
+	// so SupportsEncoding() turns them down, but they are advertised all the same
+	if (Preprocessor::Supports(modelInput)) {
+		encodings |= 1 << INPUT_ENCODING_FRAME_UINT8;
+	}
+	return encodings;
+}
+
+size_t DataProvider::EncodedSize(const TfLiteTensor* modelInput, uint8_t encoding) {
+	size_t count = modelInput->type == kTfLiteFloat32 ? modelInput->bytes / sizeof(float) : modelInput->bytes;
+	return encoding == INPUT_ENCODING_FLOAT32 ? count * sizeof(float) : count;
+}
+
+void DataProvider::Begin(SampleProgress& progress, uint8_t encoding) {
+	progress.encoding = encoding;
+	progress.offset = 0;
+}
+
+void DataProvider::Decode(SampleProgress& progress, const uint8_t* data, size_t size, const TfLiteTensor* modelInput,
+						  uint8_t* output) {
+	const size_t offset = progress.offset;
+
+	switch (progress.encoding) {
+		case INPUT_ENCODING_PIXEL_UINT8:
+			// Normalization and quantization of a pixel are a single table lookup
+			if (modelInput->type == kTfLiteFloat32) {
+				float* values = reinterpret_cast<float*>(output) + offset;
+				for (size_t i = 0; i < size; i++) {
+					values[i] = pixel_values_[data[i]];
+				}
+			} else {
+				for (size_t i = 0; i < size; i++) {
+					output[offset + i] = pixel_lut_[data[i]];
+				}
+			}
+			break;
+		case INPUT_ENCODING_QUANT_INT8:
+		case INPUT_ENCODING_QUANT_UINT8:
+			memcpy(output + offset, data, size);
+
+			// uint8 and int8 quantized values only differ by a zero point offset of 128
+			if (progress.encoding == INPUT_ENCODING_QUANT_UINT8 && modelInput->type == kTfLiteInt8) {
+				for (size_t i = offset; i < offset + size; i++) {
+					output[i] ^= 0x80;
+				}
+			}
+			break;
+		default:
+			if (quantize_) {
+				DecodeQuantized(progress, data, size, output);
+			} else {
+				memcpy(output + offset, data, size);
+			}
+			break;
+	}
+
+	progress.offset += size;
+}
+
+void DataProvider::DecodeQuantized(SampleProgress& progress, const uint8_t* data, size_t size, uint8_t* output) {
+	size_t consumed = 0;
+
+	// A value split across pieces is completed first
+	size_t split = progress.offset % sizeof(float);
+	if (split) {
+		consumed = std::min(size, sizeof(float) - split);
+		memcpy(progress.partial + split, data, consumed);
+		if (split + consumed == sizeof(float)) {
+			memcpy(chunk_, progress.partial, sizeof(float));
+			quantize_(chunk_, output + progress.offset / sizeof(float), 1, scale_, inverse_scale_, zero_point_);
+		}
+	}
+
+	// Whole values are quantized a chunk at a time, every write is bounded by the encoded size
+	while (size - consumed >= sizeof(float)) {
+		size_t count = std::min(kInputChunkSize, (size - consumed) / sizeof(float));
+		memcpy(chunk_, data + consumed, count * sizeof(float));
+		quantize_(chunk_, output + (progress.offset + consumed) / sizeof(float), count, scale_, inverse_scale_,
+				  zero_point_);
+		consumed += count * sizeof(float);
+	}
+
+	// Leading bytes of the next value
+	memcpy(progress.partial, data + consumed, size - consumed);
+}
+
+int DataProvider::Read(const InputSource& source, const TfLiteTensor* modelInput, uint8_t encoding, uint8_t* output) {
+	if (!SupportsEncoding(modelInput, encoding)) {
+		ESP_LOGE(TAG, "Input tensor type is not supported: %d", modelInput->type);
+		return 1;
+	}
+
+	// Receive one chunk at a time, so that the chunk is decoded while the
+	// network stack is already buffering the next one
+	uint8_t buffer[kInputChunkSize * sizeof(float)];
+	size_t size = EncodedSize(modelInput, encoding);
+	SampleProgress progress;
+	Begin(progress, encoding);
+
+	for (size_t offset = 0; offset < size; offset += sizeof(buffer)) {
+		size_t chunk_size = std::min(sizeof(buffer), size - offset);
+		if (source.receive(source.context, buffer, chunk_size) <= 0) {
 			ESP_LOGE(TAG, "Error occurred during receiving image: errno %d", errno);
 			return 1;
 		}
-	} else {
-		ESP_LOGE(TAG, "Input tensor type is not supported: %d", modelInput->type);
+		Decode(progress, buffer, chunk_size, modelInput, output);
+	}
+
+	return 0;
+}
+
+int DataProvider::Read(const uint8_t* data, size_t size, const TfLiteTensor* modelInput, uint8_t encoding,
+					   uint8_t* output) {
+	if (size != EncodedSize(modelInput, encoding)) {
+		ESP_LOGE(TAG, "Invalid sample size: %d (expected %d)", (int) size, (int) EncodedSize(modelInput, encoding));
 		return 1;
 	}
 
+	SampleProgress progress;
+	Begin(progress, encoding);
+	Decode(progress, data, size, modelInput, output);
 	return 0;
-}
\ No newline at end of file
+}
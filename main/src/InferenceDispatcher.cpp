@@ -0,0 +1,264 @@
+#include "InferenceDispatcher.h"
+
+#include <cstring>
+#include <new>
+
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "esp_chip_info.h"
+#include "esp_task_wdt.h"
+
+#include "protocol.h"
+#include "heap_counter.h"
+
+static const char *TAG = "[dispatcher]";
+
+int InferenceDispatcher::Init(tflite::MicroInterpreter* const* interpreters, OpProfiler* profilers,
+							   int interpreter_count, int source_count, int max_pending) {
+	if (source_count > kMaxSources) {
+		ESP_LOGE(TAG, "Too many request sources: %d (max %d)", source_count, kMaxSources);
+		return 1;
+	}
+	if (interpreter_count < 1 || interpreter_count > kMaxInterpreters) {
+		ESP_LOGE(TAG, "Invalid interpreter count: %d (max %d)", interpreter_count, kMaxInterpreters);
+		return 1;
+	}
+
+	worker_count_ = interpreter_count;
+	source_count_ = source_count;
+	for (int i = 0; i < interpreter_count; i++) {
+		Worker& worker = workers_[i];
+		worker.dispatcher = this;
+		worker.interpreter = interpreters[i];
+		worker.profiler = &profilers[i];
+		worker.input = interpreters[i]->input(0);
+		worker.output = interpreters[i]->output(0);
+
+		for (int j = 0; j < kCompletionQueueLength; j++) {
+			RanJob& ran = worker.completions[j];
+			ran.output = *worker.output;
+			ran.output.data.raw = new (std::nothrow) char[worker.output->bytes];
+			if (!ran.output.data.raw) {
+				ESP_LOGE(TAG, "Failed to allocate the output copies");
+				return 1;
+			}
+		}
+	}
+
+	// Every interpreter runs the same model, the outputs are interpreted alike
+	if (prediction_interpreter_.Init(workers_[0].output)) {
+		return 1;
+	}
+	result_.prediction.reserve(prediction_interpreter_.GetScoreCount(workers_[0].output));
+
+	next_lock_ = xSemaphoreCreateMutex();
+	queued_ = xSemaphoreCreateCounting(source_count * kSourceQueueLength, 0);
+	room_ = xSemaphoreCreateCounting(max_pending, max_pending);
+	if (!next_lock_ || !queued_ || !room_) {
+		ESP_LOGE(TAG, "Failed to create the dispatcher semaphores");
+		return 1;
+	}
+	for (int i = 0; i < source_count; i++) {
+		space_[i] = xSemaphoreCreateCounting(kSourceQueueLength, kSourceQueueLength);
+		if (!space_[i]) {
+			ESP_LOGE(TAG, "Failed to create the dispatcher semaphores");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int InferenceDispatcher::Start() {
+	if (xTaskCreatePinnedToCore(CompletionTask, "completion", 4096, this, 5, &completion_task_, kIoCore) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to create the completion task");
+		return 1;
+	}
+
+	for (int i = 0; i < worker_count_; i++) {
+		BaseType_t core = WorkerCore(i);
+		if (xTaskCreatePinnedToCore(InferenceTask, "inference", 4096, &workers_[i], WorkerPriority(i),
+									&workers_[i].task, core) != pdPASS) {
+			ESP_LOGE(TAG, "Failed to create the inference task of interpreter %d", i);
+			return 1;
+		}
+		ESP_LOGI(TAG, "Interpreter %d on core %d", i, (int) core);
+	}
+	ESP_LOGI(TAG, "Completion on core %d", (int) kIoCore);
+	return 0;
+}
+
+bool InferenceDispatcher::Submit(const InferenceJob& job, bool wait) {
+	if (job.input && xSemaphoreTake(room_, wait ? portMAX_DELAY : 0) != pdTRUE) {
+		return false;
+	}
+
+	// Only a client flooding control requests fills its queue, wait for the inference tasks to drain it
+	xSemaphoreTake(space_[job.source], portMAX_DELAY);
+	queues_[job.source].Push(job);
+	xSemaphoreGive(queued_);
+	return true;
+}
+
+// Picks the next job, serving the sources round-robin, and returns its sequence among the jobs of its source.
+// Every job taken off queued_ is in a queue, so each waiting worker finds the job it was woken up for.
+uint32_t InferenceDispatcher::Next(InferenceJob& job) {
+	while (1) {
+		xSemaphoreTake(queued_, portMAX_DELAY);
+
+		xSemaphoreTake(next_lock_, portMAX_DELAY);
+		for (int i = 0; i < source_count_; i++) {
+			int source = (next_source_ + i) % source_count_;
+			if (queues_[source].Pop(job)) {
+				next_source_ = (source + 1) % source_count_;
+				uint32_t sequence = picked_[source]++;
+				xSemaphoreGive(next_lock_);
+
+				xSemaphoreGive(space_[source]);
+				return sequence;
+			}
+		}
+		xSemaphoreGive(next_lock_);
+	}
+}
+
+// Runs the job on the inference task, the raw output is copied out before the next Invoke()
+void InferenceDispatcher::Run(Worker& worker, const InferenceJob& job, RanJob& ran) {
+	ran.job = job;
+	ran.status = STATUS_OK;
+	ran.inference_time = 0;
+
+	if (job.input) {
+		// Hold the inference back until the global compute budget allows it
+		pacing_wait_compute(&worker.pacing);
+
+		memcpy(worker.input->data.raw, job.input, worker.input->bytes);
+
+		worker.profiler->BeginInvoke();
+		long long start_time = esp_timer_get_time();
+		TfLiteStatus invoke_status = worker.interpreter->Invoke();
+		long long inference_time = esp_timer_get_time() - start_time;
+		worker.profiler->EndInvoke(invoke_status == kTfLiteOk);
+
+		if (invoke_status != kTfLiteOk) {
+			ESP_LOGE(TAG, "Invoke failed");
+			ran.status = STATUS_ERROR;
+		} else {
+			ran.inference_time = inference_time;
+			pacing_account(ran.inference_time);
+			memcpy(ran.output.data.raw, worker.output->data.raw, worker.output->bytes);
+		}
+	}
+}
+
+// A job that has run and is next to complete among the jobs of its source. The oldest job that has not
+// completed is always one of them, since every worker runs its jobs in the order it picked them.
+InferenceDispatcher::RanJob* InferenceDispatcher::Completable(Worker*& worker) {
+	for (int i = 0; i < worker_count_; i++) {
+		RanJob* ran = workers_[i].completions.Peek();
+		if (ran && ran->sequence == completed_[ran->job.source]) {
+			worker = &workers_[i];
+			return ran;
+		}
+	}
+	return nullptr;
+}
+
+// Interprets the output and completes the job on the completion task
+void InferenceDispatcher::Complete(RanJob& ran) {
+	InferenceResult& result = result_;
+	result.status = ran.status;
+	result.inference_time = ran.inference_time;
+	result.prediction.clear();
+	result.output = &ran.output;
+
+	if (ran.job.input && ran.status == STATUS_OK) {
+		// Interpret raw model predictions
+		prediction_interpreter_.GetResult(&ran.output, result.prediction);
+	}
+
+	ran.job.complete(ran.job, result);
+}
+
+void InferenceDispatcher::InferenceTask(void* args) {
+	Worker& worker = *static_cast<Worker*>(args);
+	InferenceDispatcher* dispatcher = worker.dispatcher;
+
+	esp_chip_info_t chip_info;
+	esp_chip_info(&chip_info);
+
+	uint32_t core_mask = 0;
+	// Set the core mask to include all available cores
+	for (int i = 0; i < chip_info.cores; i++) {
+		core_mask |= (1 << i);
+	}
+
+	// Increase watchdog timeout to 20 seconds
+	esp_task_wdt_config_t config = {
+		.timeout_ms = 20000,  // Set timeout to 20 sec
+		.idle_core_mask = core_mask,  // Apply to all cores
+		.trigger_panic = false  // Don't trigger panic, just log warning
+	};
+
+	esp_task_wdt_reconfigure(&config);
+
+	pacing_worker_init(&worker.pacing);
+	if (heap_counter_track_task()) {
+		ESP_LOGW(TAG, "The heap allocations of the inference task are not counted");
+	}
+
+	InferenceJob job;
+	while (1) {
+		// The completion is reserved before the job is picked, so that a picked job never waits for one
+		RanJob* ran;
+		while (!(ran = worker.completions.Reserve())) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		}
+		uint32_t sequence = dispatcher->Next(job);
+
+		// Steady state requests allocate nothing
+		uint32_t allocations = heap_allocation_count();
+		dispatcher->Run(worker, job, *ran);
+		allocations = heap_allocation_count() - allocations;
+		if (allocations) {
+			ESP_LOGW(TAG, "Inference of source %d allocated %lu times on the heap", job.source,
+					 (unsigned long) allocations);
+		}
+
+		ran->sequence = sequence;
+		worker.completions.Publish();
+		xTaskNotifyGive(dispatcher->completion_task_);
+
+		if (job.input) {
+			xSemaphoreGive(dispatcher->room_);
+		}
+	}
+}
+
+void InferenceDispatcher::CompletionTask(void* args) {
+	InferenceDispatcher* dispatcher = static_cast<InferenceDispatcher*>(args);
+	if (heap_counter_track_task()) {
+		ESP_LOGW(TAG, "The heap allocations of the completion task are not counted");
+	}
+
+	while (1) {
+		Worker* worker = nullptr;
+		RanJob* ran;
+		while (!(ran = dispatcher->Completable(worker))) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		}
+
+		uint32_t allocations = heap_allocation_count();
+		dispatcher->Complete(*ran);
+		dispatcher->completed_[ran->job.source]++;
+		allocations = heap_allocation_count() - allocations;
+		if (allocations) {
+			ESP_LOGW(TAG, "Completion of source %d allocated %lu times on the heap", ran->job.source,
+					 (unsigned long) allocations);
+		}
+
+		worker->completions.Release();
+		xTaskNotifyGive(worker->task);
+	}
+}
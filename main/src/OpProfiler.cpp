@@ -0,0 +1,143 @@
+#include "OpProfiler.h"
+
+#include <cstdio>
+
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+static const char *TAG = "[profiler]";
+
+// Operators that esp-tflite-micro runs with an esp-nn kernel, for int8 inputs only
+static bool HasEspNnKernel(tflite::BuiltinOperator op) {
+	switch (op) {
+		case tflite::BuiltinOperator_ADD:
+		case tflite::BuiltinOperator_AVERAGE_POOL_2D:
+		case tflite::BuiltinOperator_CONV_2D:
+		case tflite::BuiltinOperator_DEPTHWISE_CONV_2D:
+		case tflite::BuiltinOperator_FULLY_CONNECTED:
+		case tflite::BuiltinOperator_MAX_POOL_2D:
+		case tflite::BuiltinOperator_MUL:
+		case tflite::BuiltinOperator_SOFTMAX:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Appends "key":{"type":...,"shape":[...]} for a tensor of the subgraph, null for optional tensors
+static void AppendTensor(std::string& json, const char* key, const tflite::SubGraph* subgraph,
+						 const flatbuffers::Vector<int32_t>* indices) {
+	json += "\"";
+	json += key;
+	json += "\":";
+
+	if (!indices || indices->size() == 0 || indices->Get(0) < 0) {
+		json += "null";
+		return;
+	}
+
+	const tflite::Tensor* tensor = subgraph->tensors()->Get(indices->Get(0));
+	json += "{\"type\":\"";
+	json += tflite::EnumNameTensorType(tensor->type());
+	json += "\",\"shape\":[";
+	const flatbuffers::Vector<int32_t>* shape = tensor->shape();
+	for (uint32_t i = 0; shape && i < shape->size(); i++) {
+		json += (i ? "," : "") + std::to_string(shape->Get(i));
+	}
+	json += "]}";
+}
+
+int OpProfiler::Init(const tflite::Model* model) {
+	if (!model->subgraphs() || model->subgraphs()->size() == 0) {
+		ESP_LOGE(TAG, "The model has no subgraph");
+		return 1;
+	}
+
+	const tflite::SubGraph* subgraph = model->subgraphs()->Get(0);
+	uint32_t op_count = subgraph->operators() ? subgraph->operators()->size() : 0;
+	ops_.resize(op_count);
+
+	for (uint32_t i = 0; i < op_count; i++) {
+		const tflite::Operator* op = subgraph->operators()->Get(i);
+		tflite::BuiltinOperator code = tflite::GetBuiltinCode(model->operator_codes()->Get(op->opcode_index()));
+
+		bool esp_nn = false;
+		if (HasEspNnKernel(code) && op->inputs() && op->inputs()->size() > 0 && op->inputs()->Get(0) >= 0) {
+			esp_nn = subgraph->tensors()->Get(op->inputs()->Get(0))->type() == tflite::TensorType_INT8;
+		}
+
+		std::string& info = ops_[i].info;
+		info = "\"index\":" + std::to_string(i) + ",\"op\":\"" + tflite::EnumNameBuiltinOperator(code) + "\",";
+		AppendTensor(info, "input", subgraph, op->inputs());
+		info += ",";
+		AppendTensor(info, "output", subgraph, op->outputs());
+		info += esp_nn ? ",\"esp_nn\":true" : ",\"esp_nn\":false";
+	}
+
+	return 0;
+}
+
+// Operators of nested subgraphs (control flow) are numbered past the main subgraph and ignored
+uint32_t OpProfiler::BeginEvent(const char* tag) {
+	uint32_t event = next_event_++;
+	if (event < ops_.size()) {
+		ops_[event].start_us = static_cast<uint32_t>(esp_timer_get_time());
+		ops_[event].start_cycles = esp_cpu_get_cycle_count();
+	}
+	return event;
+}
+
+void OpProfiler::EndEvent(uint32_t event_handle) {
+	if (event_handle < ops_.size()) {
+		Op& op = ops_[event_handle];
+		op.cycles[position_] = esp_cpu_get_cycle_count() - op.start_cycles;
+		op.micros[position_] = static_cast<uint32_t>(esp_timer_get_time()) - op.start_us;
+	}
+}
+
+void OpProfiler::BeginInvoke() {
+	next_event_ = 0;
+}
+
+void OpProfiler::EndInvoke(bool ok) {
+	if (!ok || next_event_ != ops_.size()) {
+		return;
+	}
+
+	portENTER_CRITICAL(&lock_);
+	position_ = (position_ + 1) % kWindow;
+	if (samples_ < kWindow - 1) {
+		samples_++;
+	}
+	portEXIT_CRITICAL(&lock_);
+}
+
+void OpProfiler::GetStats(int op, OpStats& stats) {
+	const Op& entry = ops_[op];
+	uint64_t micros = 0, cycles = 0;
+	uint32_t min_us = UINT32_MAX, max_us = 0;
+
+	// The window cannot move on while it is read
+	portENTER_CRITICAL(&lock_);
+	int samples = samples_;
+	for (int i = 1; i <= samples; i++) {
+		int slot = (position_ - i + kWindow) % kWindow;
+		micros += entry.micros[slot];
+		cycles += entry.cycles[slot];
+		min_us = entry.micros[slot] < min_us ? entry.micros[slot] : min_us;
+		max_us = entry.micros[slot] > max_us ? entry.micros[slot] : max_us;
+	}
+	portEXIT_CRITICAL(&lock_);
+
+	if (!samples) {
+		return;
+	}
+
+	uint32_t total = stats.samples + samples;
+	stats.mean_us = (stats.mean_us * stats.samples + micros) / total;
+	stats.mean_cycles = (stats.mean_cycles * stats.samples + cycles) / total;
+	stats.min_us = stats.samples && stats.min_us < min_us ? stats.min_us : min_us;
+	stats.max_us = stats.max_us > max_us ? stats.max_us : max_us;
+	stats.samples = total;
+}
@@ -4,25 +4,221 @@
 #include <freertos/task.h>
 #include <esp_log.h>
 
+#include "protocol.h"
+#include "boot_timeline.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
 #include <iostream>
 #include <iomanip>
 
-static const char *TAG = "[tcp_server]";
 
-int PredictionHandler::Update(int client_socket, const std::vector<float>& predictions, long long inference_time) {
-	int err;
-	
-	err = tcp_server_send(client_socket, (void*) predictions.data(), predictions.size() * sizeof(float));
-	if (err < 0) {
-		ESP_LOGE(TAG, "Failed to send inference result to client");
-		return 1;
+// Largest result over every response mode, see AppendResult()
+static size_t MaxResultSize(size_t score_count, const TfLiteTensor* output) {
+	size_t full = score_count * sizeof(float) + sizeof(long long);
+	size_t argmax = sizeof(uint16_t);
+	size_t top_k = sizeof(uint8_t) + std::min<size_t>(score_count, UINT8_MAX) * (sizeof(uint16_t) + sizeof(float));
+	size_t sparse = sizeof(uint16_t) + score_count * (sizeof(uint16_t) + sizeof(float));
+	size_t raw = output->type == kTfLiteInt8 ? sizeof(float) + sizeof(int32_t) + output->bytes : 0;
+	// Every mode but the full scores may add the inference time
+	return std::max(full, std::max({argmax, top_k, sparse, raw}) + sizeof(long long));
+}
+
+// Size of a tensor descriptor of the handshake reply
+static size_t TensorInfoSize(const TfLiteTensor* tensor) {
+	return 2 * sizeof(uint8_t) + tensor->dims->size * sizeof(int32_t) + sizeof(float) + sizeof(int32_t);
+}
+
+void PredictionHandler::Init(size_t score_count, const TfLiteTensor* input, const TfLiteTensor* output) {
+	sparse_.reserve(score_count);
+	labels_.reserve(score_count);
+	score_count_ = score_count;
+	result_size_ = MaxResultSize(score_count, output);
+
+	info_size_ = 2 * sizeof(uint8_t) + 2 * sizeof(uint32_t) +
+				 2 * sizeof(uint8_t) + strnlen(APPLICATION_TYPE, UINT8_MAX) + strnlen(FIRMWARE_VERSION, UINT8_MAX) +
+				 TensorInfoSize(input) + TensorInfoSize(output) +
+				 sizeof(uint8_t) + BOOT_PHASE_COUNT * 2 * sizeof(uint32_t);
+}
+
+size_t PredictionHandler::ReplyCapacity() const {
+	size_t capacity = 0;
+	for (uint8_t type : {REQUEST_INFO, REQUEST_INFER, REQUEST_INFER_TAGGED, REQUEST_INFER_BATCH}) {
+		capacity = std::max(capacity, MaxReplySize(type, 0));
+	}
+	return capacity;
+}
+
+size_t PredictionHandler::MaxReplySize(uint8_t type, uint8_t batch_index) const {
+	switch (type) {
+		case REQUEST_INFO:
+			return info_size_;
+		case REQUEST_INFER:
+			return result_size_;
+		case REQUEST_INFER_TAGGED:
+			return sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint16_t) + result_size_;
+		case REQUEST_INFER_BATCH:
+			return (batch_index == 0 ? sizeof(uint8_t) + sizeof(uint16_t) : 0) +
+				   score_count_ * sizeof(float) + sizeof(long long);
+		default:
+			return sizeof(uint8_t);
+	}
+}
+
+void PredictionHandler::BuildStatus(std::vector<uint8_t>& reply, uint8_t status) {
+	reply.clear();
+	reply.push_back(status);
+}
+
+template <typename T>
+static void Append(std::vector<uint8_t>& reply, const T& value) {
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+	reply.insert(reply.end(), bytes, bytes + sizeof(T));
+}
+
+static void AppendString(std::vector<uint8_t>& reply, const char* str) {
+	uint8_t length = strnlen(str, UINT8_MAX);
+	Append(reply, length);
+	reply.insert(reply.end(), str, str + length);
+}
+
+void PredictionHandler::AppendTensorInfo(std::vector<uint8_t>& reply, const TfLiteTensor* tensor) {
+	Append<uint8_t>(reply, tensor->type);
+	Append<uint8_t>(reply, tensor->dims->size);
+	for (int i = 0; i < tensor->dims->size; i++) {
+		Append<int32_t>(reply, tensor->dims->data[i]);
+	}
+	Append<float>(reply, tensor->params.scale);
+	Append<int32_t>(reply, tensor->params.zero_point);
+}
+
+void PredictionHandler::BuildInfo(std::vector<uint8_t>& reply, const ModelInfo& model_info,
+								  const TfLiteTensor* input, const TfLiteTensor* output, uint8_t input_encodings) {
+	reply.clear();
+
+	Append<uint8_t>(reply, PROTOCOL_VERSION);
+	Append<uint8_t>(reply, input_encodings);
+	Append<uint32_t>(reply, model_info.hash);
+	Append<uint32_t>(reply, model_info.size);
+	AppendString(reply, APPLICATION_TYPE);
+	AppendString(reply, FIRMWARE_VERSION);
+	AppendTensorInfo(reply, input);
+	AppendTensorInfo(reply, output);
+
+	boot_timeline_t boot;
+	boot_timeline_get(&boot, nullptr);
+	Append<uint8_t>(reply, BOOT_PHASE_COUNT);
+	for (const boot_phase_time_t& phase : boot.phases) {
+		Append<uint32_t>(reply, phase.start_us);
+		Append<uint32_t>(reply, phase.duration_us);
+	}
+}
+
+bool PredictionHandler::SupportsResponse(const ResponseFormat& format, const TfLiteTensor* output) {
+	switch (format.mode & ~RESPONSE_WITH_TIME) {
+		case RESPONSE_FULL:
+			// The full scores always carry the inference time
+			return format.mode == RESPONSE_FULL;
+		case RESPONSE_ARGMAX:
+			return true;
+		case RESPONSE_TOP_K:
+			return format.top_k > 0;
+		case RESPONSE_RAW_INT8:
+			return output->type == kTfLiteInt8;
+		case RESPONSE_SPARSE:
+			return !std::isnan(format.threshold);
+		default:
+			return false;
+	}
+}
+
+void PredictionHandler::AppendResult(std::vector<uint8_t>& reply, const ResponseFormat& format,
+									 const std::vector<float>& predictions, const TfLiteTensor* output,
+									 long long inference_time) {
+	switch (format.mode & ~RESPONSE_WITH_TIME) {
+		case RESPONSE_ARGMAX: {
+			auto best = std::max_element(predictions.begin(), predictions.end());
+			Append<uint16_t>(reply, best - predictions.begin());
+			break;
+		}
+		case RESPONSE_TOP_K: {
+			labels_.resize(predictions.size());
+			std::iota(labels_.begin(), labels_.end(), 0);
+
+			size_t count = std::min<size_t>(format.top_k, labels_.size());
+			std::partial_sort(labels_.begin(), labels_.begin() + count, labels_.end(),
+							  [&](uint16_t a, uint16_t b) { return predictions[a] > predictions[b]; });
+
+			Append<uint8_t>(reply, count);
+			for (size_t i = 0; i < count; i++) {
+				Append(reply, labels_[i]);
+				Append(reply, predictions[labels_[i]]);
+			}
+			break;
+		}
+		case RESPONSE_SPARSE:
+			prediction_interpreter_.GetSparseResult(predictions, format.threshold, sparse_);
+			Append<uint16_t>(reply, sparse_.size());
+			for (const LabelScore& entry : sparse_) {
+				Append(reply, entry.label);
+				Append(reply, entry.score);
+			}
+			break;
+		case RESPONSE_RAW_INT8:
+			Append<float>(reply, output->params.scale);
+			Append<int32_t>(reply, output->params.zero_point);
+			reply.insert(reply.end(), output->data.uint8, output->data.uint8 + output->bytes);
+			break;
+		default: {
+			const uint8_t* scores = reinterpret_cast<const uint8_t*>(predictions.data());
+			reply.insert(reply.end(), scores, scores + predictions.size() * sizeof(float));
+			Append(reply, inference_time);
+			return;
+		}
+	}
+
+	if (format.mode & RESPONSE_WITH_TIME) {
+		Append(reply, inference_time);
+	}
+}
+
+void PredictionHandler::BuildResult(std::vector<uint8_t>& reply, const ResponseFormat& format,
+									const std::vector<float>& predictions, const TfLiteTensor* output,
+									long long inference_time) {
+	reply.clear();
+	AppendResult(reply, format, predictions, output, inference_time);
+}
+
+void PredictionHandler::BuildTagged(std::vector<uint8_t>& reply, uint32_t request_id, uint8_t status,
+									const ResponseFormat& format, const std::vector<float>& predictions,
+									const TfLiteTensor* output, long long inference_time) {
+	uint16_t payload_length = 0;
+
+	reply.clear();
+
+	Append(reply, request_id);
+	Append(reply, status);
+	Append(reply, payload_length);
+	if (status == STATUS_OK) {
+		size_t header_size = reply.size();
+		AppendResult(reply, format, predictions, output, inference_time);
+
+		payload_length = reply.size() - header_size;
+		memcpy(reply.data() + header_size - sizeof(payload_length), &payload_length, sizeof(payload_length));
 	}
+}
 
-	err = tcp_server_send(client_socket, (void*) &inference_time, sizeof(inference_time));
-	if (err < 0) {
-		ESP_LOGE(TAG, "Failed to send inference time to client");
-		return 1;
+void PredictionHandler::BuildBatchSample(std::vector<uint8_t>& reply, uint8_t sample_index, uint8_t sample_count,
+										 const std::vector<float>& predictions, long long inference_time) {
+	reply.clear();
+	if (sample_index == 0) {
+		Append<uint8_t>(reply, sample_count);
+		Append<uint16_t>(reply, predictions.size());
 	}
 
-	return 0;
-}
\ No newline at end of file
+	const uint8_t* scores = reinterpret_cast<const uint8_t*>(predictions.data());
+	reply.insert(reply.end(), scores, scores + predictions.size() * sizeof(float));
+	Append(reply, inference_time);
+}
@@ -8,102 +8,44 @@
 
 static const char *TAG = "[PredictionInterpreter]";
 
-std::vector<float> PredictionInterpreter::GetResult(const TfLiteTensor* output_tensor, float threshold) {
-	std::vector<float> results(output_tensor->bytes / GetTypeSize(output_tensor->type));
-
-	// Handle quantized output
-	Dequantize(output_tensor, results);
+int PredictionInterpreter::Init(const TfLiteTensor* output_tensor) {
+	// Scale should not be zero in the case of quantized tensors
+	if (output_tensor->quantization.type != kTfLiteNoQuantization && output_tensor->params.scale == 0) {
+		ESP_LOGE(TAG, "Scale is zero, invalid quantization parameters");
+		return 1;
+	}
 
-	// Remove elements with scores below the threshold
-	for (auto it = results.begin(); it != results.end();) {
-		if (*it < threshold) {
-			it = results.erase(it);
-		} 
-		else {
-			++it;
-		}
+	dequantize_ = GetDequantizeKernel(output_tensor);
+	if (!dequantize_) {
+		ESP_LOGE(TAG, "Unsupported tensor type: %d", output_tensor->type);
+		return 1;
 	}
-	return results;
+
+	score_count_ = GetScoreCount(output_tensor);
+	scale_ = output_tensor->params.scale;
+	zero_point_ = output_tensor->params.zero_point;
+	return 0;
 }
 
-void PredictionInterpreter::Dequantize(const TfLiteTensor* output_tensor, std::vector<float>& results) {
-	int size = results.size();
-	float scale = output_tensor->params.scale;
-	int zero_point = output_tensor->params.zero_point;
+void PredictionInterpreter::GetResult(const TfLiteTensor* output_tensor, std::vector<float>& results) {
+	results.resize(score_count_);
 
-	// Scale should not be zero in the case of quantized tensors
-	if (output_tensor->quantization.type != kTfLiteNoQuantization && scale == 0) {
-		ESP_LOGE(TAG, "Scale is zero, invalid quantization parameters");
-		vTaskDelete(NULL);
-	}
+	// Handle quantized output
+	dequantize_(output_tensor->data.raw, results.data(), score_count_, scale_, zero_point_);
+}
 
-	switch (output_tensor->type) {
-		case kTfLiteFloat32: {
-			const float* data = output_tensor->data.f;
-			for (int i = 0; i < size; i++) {
-				results[i] = data[i];
-			}
-			break;
-		}
-		case kTfLiteUInt8: {
-			const uint8_t* data = output_tensor->data.uint8;
-			if (output_tensor->quantization.type == kTfLiteNoQuantization) {
-				for (int i = 0; i < size; i++) {
-					results[i] = data[i];
-				}
-			}
-			else {
-				for (int i = 0; i < size; i++) {
-					results[i] = (data[i] - zero_point) * scale;
-				}
-			}
-			break;
-		}
-		case kTfLiteInt8: {
-			const int8_t* data = output_tensor->data.int8;
-			if (output_tensor->quantization.type == kTfLiteNoQuantization) {
-				for (int i = 0; i < size; i++) {
-					results[i] = data[i];
-				}
-			}
-			else {
-				for (int i = 0; i < size; i++) {
-					results[i] = (data[i] - zero_point) * scale;
-				}
-			}
-			break;
-		}
-		case kTfLiteInt16: {
-			const int16_t* data = output_tensor->data.i16;
-			if (output_tensor->quantization.type == kTfLiteNoQuantization) {
-				for (int i = 0; i < size; i++) {
-					results[i] = data[i];
-				}
-			}
-			else {
-				for (int i = 0; i < size; i++) {
-					results[i] = (data[i] - zero_point) * scale;
-				}
-			}
-			break;
-		}
-		case kTfLiteInt32: {
-			const int32_t* data = output_tensor->data.i32;
-			for (int i = 0; i < size; i++) {
-				results[i] = static_cast<float>(data[i]);
-			}
-			break;
-		}
-		case kTfLiteBool: {
-			const bool* data = output_tensor->data.b;
-			for (int i = 0; i < size; i++) {
-				results[i] = data[i] ? 1.0f : 0.0f;
-			}
-			break;
-		}
-		default: {
-			ESP_LOGE(TAG, "Unsupported tensor type: %d", output_tensor->type);
-			vTaskDelete(NULL);
+size_t PredictionInterpreter::GetScoreCount(const TfLiteTensor* output_tensor) {
+	return output_tensor->bytes / GetTypeSize(output_tensor->type);
+}
+
+void PredictionInterpreter::GetSparseResult(const std::vector<float>& scores, float threshold,
+											std::vector<LabelScore>& results) {
+	// Single pass, the storage only grows until it fits the whole output once
+	results.clear();
+	results.reserve(scores.size());
+	for (size_t i = 0; i < scores.size(); i++) {
+		if (scores[i] >= threshold) {
+			results.push_back({static_cast<uint16_t>(i), scores[i]});
 		}
 	}
 }
@@ -0,0 +1,171 @@
+#include "Preprocessor.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+#include <cstring>
+
+static const char *TAG = "tcp_server";
+
+bool Preprocessor::Supports(const TfLiteTensor* modelInput) {
+	return modelInput->dims->size >= 3 &&
+		   (modelInput->type == kTfLiteFloat32 || GetQuantizeKernel(modelInput) != nullptr);
+}
+
+// Checks the whole configuration before touching any state, a rejected one leaves the previous configuration,
+// its tables and its row buffer in place
+int Preprocessor::Configure(const PreprocessConfig& config, const TfLiteTensor* modelInput) {
+	PreprocessConfig checked = config;
+	if (checked.crop_width == 0 || checked.crop_height == 0) {
+		checked.crop_x = 0;
+		checked.crop_y = 0;
+		checked.crop_width = checked.frame_width;
+		checked.crop_height = checked.frame_height;
+	}
+
+	// The input tensor is [1, height, width(, channels)]
+	const TfLiteIntArray* dims = modelInput->dims;
+	int tensor_channels = dims->size > 3 ? dims->data[3] : 1;
+	if (dims->size < 3 || tensor_channels != checked.channels) {
+		ESP_LOGE(TAG, "Frames of %d channels do not fit the input tensor", checked.channels);
+		return 1;
+	}
+
+	if (checked.channels == 0 || checked.channels > PreprocessConfig::kMaxChannels ||
+		checked.frame_width * checked.channels > kMaxRowSize ||
+		checked.resize_mode > RESIZE_BILINEAR ||
+		checked.crop_x + checked.crop_width > checked.frame_width ||
+		checked.crop_y + checked.crop_height > checked.frame_height ||
+		checked.crop_width == 0 || checked.crop_height == 0) {
+		ESP_LOGE(TAG, "Invalid preprocessing configuration");
+		return 1;
+	}
+	for (int c = 0; c < checked.channels; c++) {
+		if (checked.std[c] == 0.0f) {
+			ESP_LOGE(TAG, "Invalid standard deviation of channel %d", c);
+			return 1;
+		}
+	}
+
+	QuantizeKernel quantize = GetQuantizeKernel(modelInput);
+	if (modelInput->type != kTfLiteFloat32 && !quantize) {
+		ESP_LOGE(TAG, "Input tensor type is not supported: %d", modelInput->type);
+		return 1;
+	}
+
+	config_ = checked;
+	output_height_ = dims->data[1];
+	output_width_ = dims->data[2];
+	float_output_ = modelInput->type == kTfLiteFloat32;
+
+	BuildTaps(columns_, output_width_, config_.crop_x, config_.crop_width);
+	BuildTaps(rows_, output_height_, config_.crop_y, config_.crop_height);
+	row_buffer_.resize(2 * config_.frame_width * config_.channels);
+
+	// Normalization and quantization of every channel collapse into a lookup table
+	values_.resize(256 * config_.channels);
+	lut_.resize(256 * config_.channels);
+	for (int c = 0; c < config_.channels; c++) {
+		for (int pixel = 0; pixel < 256; pixel++) {
+			values_[c * 256 + pixel] = (pixel / 255.0f - config_.mean[c]) / config_.std[c];
+		}
+	}
+	if (quantize) {
+		quantize(values_.data(), lut_.data(), values_.size(), modelInput->params.scale,
+				 1.0f / modelInput->params.scale, modelInput->params.zero_point);
+	}
+
+	configured_ = true;
+	return 0;
+}
+
+size_t Preprocessor::FrameSize() const {
+	return static_cast<size_t>(config_.frame_width) * config_.frame_height * config_.channels;
+}
+
+void Preprocessor::BuildTaps(std::vector<Tap>& taps, int output_size, int crop_offset, int crop_size) {
+	taps.resize(output_size);
+	for (int i = 0; i < output_size; i++) {
+		Tap& tap = taps[i];
+		if (config_.resize_mode == RESIZE_NEAREST) {
+			// Center of the output pixel, in source pixels
+			tap.first = crop_offset + ((2 * i + 1) * crop_size) / (2 * output_size);
+			tap.second = tap.first;
+			tap.weight = 0;
+			continue;
+		}
+
+		// Half pixel centers in Q8: (i + 0.5) * crop_size / output_size - 0.5
+		int64_t scaled = static_cast<int64_t>(2 * i + 1) * crop_size * 256 / (2 * output_size) - 128;
+		int position = std::clamp<int64_t>(scaled, 0, (crop_size - 1) * 256);
+		tap.first = crop_offset + (position >> 8);
+		tap.second = crop_offset + std::min((position >> 8) + 1, crop_size - 1);
+		tap.weight = position & 0xFF;
+	}
+}
+
+void Preprocessor::EmitRow(int output_row, const uint8_t* first, const uint8_t* second, uint8_t weight,
+						   uint8_t* output) {
+	const int channels = config_.channels;
+	const int row_weight = weight;
+	size_t index = output_row * output_width_ * channels;
+
+	for (int x = 0; x < output_width_; x++) {
+		const Tap& column = columns_[x];
+		const int column_weight = column.weight;
+
+		for (int c = 0; c < channels; c++, index++) {
+			int left = column.first * channels + c;
+			int right = column.second * channels + c;
+
+			// Q8 x Q8 interpolation, rounded back to an 8-bit pixel
+			int top = first[left] * (256 - column_weight) + first[right] * column_weight;
+			int bottom = second[left] * (256 - column_weight) + second[right] * column_weight;
+			int pixel = (top * (256 - row_weight) + bottom * row_weight + (1 << 15)) >> 16;
+
+			if (float_output_) {
+				reinterpret_cast<float*>(output)[index] = values_[c * 256 + pixel];
+			} else {
+				output[index] = lut_[c * 256 + pixel];
+			}
+		}
+	}
+}
+
+void Preprocessor::Begin() {
+	row_ = 0;
+	row_offset_ = 0;
+	output_row_ = 0;
+}
+
+void Preprocessor::Feed(const uint8_t* data, size_t size, uint8_t* output) {
+	const size_t row_size = config_.frame_width * config_.channels;
+
+	while (size > 0) {
+		size_t count = std::min(size, row_size - row_offset_);
+		memcpy(row_buffer_.data() + (row_ & 1) * row_size + row_offset_, data, count);
+		row_offset_ += count;
+		data += count;
+		size -= count;
+
+		if (row_offset_ == row_size) {
+			EndRow(output);
+		}
+	}
+}
+
+// Every frame row is received, the rows that feed the output are used
+// as soon as both of their neighbours have arrived
+void Preprocessor::EndRow(uint8_t* output) {
+	const size_t row_size = config_.frame_width * config_.channels;
+	const uint8_t* row = row_buffer_.data() + (row_ & 1) * row_size;
+
+	while (output_row_ < output_height_ && rows_[output_row_].second == row_) {
+		const Tap& tap = rows_[output_row_];
+		EmitRow(output_row_, row_buffer_.data() + (tap.first & 1) * row_size, row, tap.weight, output);
+		output_row_++;
+	}
+
+	row_++;
+	row_offset_ = 0;
+}
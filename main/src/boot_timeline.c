@@ -0,0 +1,109 @@
+#include "boot_timeline.h"
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+static const char *TAG = "[boot]";
+
+// Marks the RTC record as written by a firmware with this layout, anything else is power-on garbage
+#define BOOT_TIMELINE_MAGIC	0xB0071E01
+
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t boot_count;
+	uint32_t has_previous;
+	boot_timeline_t previous;
+	boot_timeline_t current;
+} boot_record_t;
+
+// Left alone by the startup code, so it survives every reset but a power-on (or brownout) one
+static RTC_NOINIT_ATTR boot_record_t boot_record;
+
+static portMUX_TYPE boot_lock = portMUX_INITIALIZER_UNLOCKED;
+// Start of the phases in progress
+static int64_t phase_start[BOOT_PHASE_COUNT];
+
+static const char *const phase_names[BOOT_PHASE_COUNT] = {
+	"nvs_flash_init",
+	"connect_wifi",
+	"akri_server_start",
+	"get_model",
+	"arena_allocation",
+	"allocate_tensors",
+	"warmup",
+};
+
+void boot_timeline_init(void)
+{
+	esp_reset_reason_t reason = esp_reset_reason();
+
+	if (reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT ||
+		boot_record.magic != BOOT_TIMELINE_MAGIC || boot_record.size != sizeof(boot_record)) {
+		memset(&boot_record, 0, sizeof(boot_record));
+		boot_record.magic = BOOT_TIMELINE_MAGIC;
+		boot_record.size = sizeof(boot_record);
+	} else {
+		boot_record.previous = boot_record.current;
+		boot_record.has_previous = 1;
+	}
+
+	boot_record.boot_count++;
+	memset(&boot_record.current, 0, sizeof(boot_record.current));
+	strncpy(boot_record.current.firmware_version, FIRMWARE_VERSION,
+			sizeof(boot_record.current.firmware_version) - 1);
+	boot_record.current.reset_reason = reason;
+
+	ESP_LOGI(TAG, "Boot %lu since power-on, reset reason %d", (unsigned long) boot_record.boot_count, (int) reason);
+}
+
+void boot_phase_begin(boot_phase_t phase)
+{
+	int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL(&boot_lock);
+	phase_start[phase] = now;
+	if (!boot_record.current.phases[phase].start_us) {
+		boot_record.current.phases[phase].start_us = (uint32_t) now;
+	}
+	portEXIT_CRITICAL(&boot_lock);
+}
+
+void boot_phase_end(boot_phase_t phase)
+{
+	int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL(&boot_lock);
+	boot_record.current.phases[phase].duration_us += (uint32_t) (now - phase_start[phase]);
+	portEXIT_CRITICAL(&boot_lock);
+
+	ESP_LOGI(TAG, "%s done at %lld us", phase_names[phase], now);
+}
+
+const char *boot_phase_name(boot_phase_t phase)
+{
+	return phase < BOOT_PHASE_COUNT ? phase_names[phase] : "unknown";
+}
+
+uint32_t boot_timeline_count(void)
+{
+	return boot_record.boot_count;
+}
+
+int boot_timeline_get(boot_timeline_t *current, boot_timeline_t *previous)
+{
+	portENTER_CRITICAL(&boot_lock);
+	*current = boot_record.current;
+	if (previous && boot_record.has_previous) {
+		*previous = boot_record.previous;
+	}
+	int err = !boot_record.has_previous;
+	portEXIT_CRITICAL(&boot_lock);
+
+	return err;
+}
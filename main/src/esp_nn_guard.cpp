@@ -0,0 +1,8 @@
+#include "esp_nn_guard.h"
+
+SemaphoreHandle_t esp_nn_scratch_lock() {
+	// Created while the op resolver is built in setup(), before any interpreter runs. A mutex, so that an
+	// interpreter at a lower priority holding it inherits the priority of the one waiting for it.
+	static SemaphoreHandle_t lock = xSemaphoreCreateMutex();
+	return lock;
+}
@@ -0,0 +1,77 @@
+#include "heap_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Tasks whose allocations are counted, along with their counts. Slots are only ever added, and each
+// count is only written by its own task, so that counting an allocation takes no lock.
+static TaskHandle_t tracked_tasks[HEAP_COUNTER_MAX_TASKS];
+static uint32_t allocation_counts[HEAP_COUNTER_MAX_TASKS];
+static std::atomic<int> tracked_count{0};
+static portMUX_TYPE track_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int IRAM_ATTR find_task(TaskHandle_t task) {
+	int count = tracked_count.load(std::memory_order_acquire);
+	for (int i = 0; i < count; i++) {
+		if (tracked_tasks[i] == task) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void IRAM_ATTR count_allocation(void) {
+	int index = find_task(xTaskGetCurrentTaskHandle());
+	if (index >= 0) {
+		allocation_counts[index]++;
+	}
+}
+
+int heap_counter_track_task(void) {
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	int err = 0;
+
+	portENTER_CRITICAL(&track_lock);
+	int count = tracked_count.load(std::memory_order_relaxed);
+	if (find_task(task) < 0) {
+		if (count < HEAP_COUNTER_MAX_TASKS) {
+			tracked_tasks[count] = task;
+			allocation_counts[count] = 0;
+			tracked_count.store(count + 1, std::memory_order_release);
+		} else {
+			err = 1;
+		}
+	}
+	portEXIT_CRITICAL(&track_lock);
+
+	return err;
+}
+
+uint32_t heap_allocation_count(void) {
+	int index = find_task(xTaskGetCurrentTaskHandle());
+	return index >= 0 ? allocation_counts[index] : 0;
+}
+
+#ifdef CONFIG_HEAP_USE_HOOKS
+// Called by the heap component for every allocation: malloc(), heap_caps_*() and operator new, which calls malloc()
+extern "C" void IRAM_ATTR esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+	count_allocation();
+}
+#else
+// Replaces the global allocation function, the array and nothrow variants call into it
+void* operator new(std::size_t size) {
+	count_allocation();
+
+	void* ptr = malloc(size ? size : 1);
+	if (!ptr) {
+		abort();
+	}
+	return ptr;
+}
+#endif
@@ -1,8 +1,12 @@
 #include <string.h>
+#include <stdlib.h>
+#include <math.h>
 #include "esp_log.h"
 #include "esp_http_server.h"
 #include "http_server.h"
 #include "esp_random.h"
+#include "pacing.h"
+#include "boot_timeline.h"
 
 // See here:
 // https://github.com/espressif/esp-idf/blob/master/examples/protocols/http_server/simple/main/main.c
@@ -25,4 +29,116 @@ esp_err_t temp_get_handler(httpd_req_t *req)
 	snprintf(resp_str, sizeof(resp_str), "%d", random_temp);
 	httpd_resp_send(req, resp_str, strlen(resp_str));
 	return ESP_OK;
-}
\ No newline at end of file
+}
+
+static esp_err_t pacing_send_config(httpd_req_t *req)
+{
+	pacing_config_t config;
+	pacing_get_config(&config);
+
+	char temperature[16];
+	float celsius = pacing_get_temperature();
+	if (isnan(celsius)) {
+		strcpy(temperature, "null");
+	} else {
+		snprintf(temperature, sizeof(temperature), "%.1f", celsius);
+	}
+
+	char json_response[320];
+	snprintf(json_response, sizeof(json_response),
+				"{\"connection_rate\":%.2f,\"connection_burst\":%.0f,"
+				"\"max_duty_cycle\":%.2f,\"min_duty_cycle\":%.2f,"
+				"\"throttle_temp\":%.1f,\"critical_temp\":%.1f,"
+				"\"yield_interval_ms\":%lu,\"temperature\":%s,\"duty_cycle\":%.2f}",
+				config.connection_rate, config.connection_burst,
+				config.max_duty_cycle, config.min_duty_cycle,
+				config.throttle_temp, config.critical_temp,
+				(unsigned long) config.yield_interval_ms, temperature, pacing_get_duty_cycle());
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_send(req, json_response, strlen(json_response));
+	return ESP_OK;
+}
+
+static void query_get_float(const char *query, const char *key, float *value)
+{
+	char buf[16];
+	if (httpd_query_key_value(query, key, buf, sizeof(buf)) == ESP_OK) {
+		*value = strtof(buf, NULL);
+	}
+}
+
+esp_err_t pacing_get_handler(httpd_req_t *req)
+{
+	return pacing_send_config(req);
+}
+
+// Updates the pacing configuration from the query string, e.g.
+// POST /pacing?connection_rate=5&max_duty_cycle=0.8
+esp_err_t pacing_post_handler(httpd_req_t *req)
+{
+	char query[256];
+	if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing pacing parameters");
+		return ESP_FAIL;
+	}
+
+	pacing_config_t config;
+	pacing_get_config(&config);
+
+	float yield_interval = config.yield_interval_ms;
+	query_get_float(query, "connection_rate", &config.connection_rate);
+	query_get_float(query, "connection_burst", &config.connection_burst);
+	query_get_float(query, "max_duty_cycle", &config.max_duty_cycle);
+	query_get_float(query, "min_duty_cycle", &config.min_duty_cycle);
+	query_get_float(query, "throttle_temp", &config.throttle_temp);
+	query_get_float(query, "critical_temp", &config.critical_temp);
+	query_get_float(query, "yield_interval_ms", &yield_interval);
+	config.yield_interval_ms = yield_interval > 0 ? (uint32_t) yield_interval : 0;
+
+	if (pacing_set_config(&config)) {
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid pacing configuration");
+		return ESP_FAIL;
+	}
+
+	return pacing_send_config(req);
+}
+
+static void boot_send_timeline(httpd_req_t *req, const boot_timeline_t *timeline)
+{
+	char chunk[96];
+	snprintf(chunk, sizeof(chunk), "{\"version\":\"%s\",\"reset_reason\":%lu,\"phases\":{",
+				timeline->firmware_version, (unsigned long) timeline->reset_reason);
+	httpd_resp_sendstr_chunk(req, chunk);
+
+	for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+		snprintf(chunk, sizeof(chunk), "%s\"%s\":{\"start_us\":%lu,\"duration_us\":%lu}",
+					i ? "," : "", boot_phase_name(i), (unsigned long) timeline->phases[i].start_us,
+					(unsigned long) timeline->phases[i].duration_us);
+		httpd_resp_sendstr_chunk(req, chunk);
+	}
+	httpd_resp_sendstr_chunk(req, "}}");
+}
+
+// Start and duration of every startup phase of this boot and of the previous one, which
+// is null after a power-on reset. Phases that were not reached (yet) have a zero start.
+esp_err_t boot_get_handler(httpd_req_t *req)
+{
+	boot_timeline_t current, previous;
+	int has_previous = !boot_timeline_get(&current, &previous);
+
+	char chunk[48];
+	httpd_resp_set_type(req, "application/json");
+	snprintf(chunk, sizeof(chunk), "{\"boot_count\":%lu,\"current\":", (unsigned long) boot_timeline_count());
+	httpd_resp_sendstr_chunk(req, chunk);
+	boot_send_timeline(req, &current);
+
+	httpd_resp_sendstr_chunk(req, ",\"previous\":");
+	if (has_previous) {
+		boot_send_timeline(req, &previous);
+	} else {
+		httpd_resp_sendstr_chunk(req, "null");
+	}
+
+	httpd_resp_sendstr_chunk(req, "}");
+	return httpd_resp_sendstr_chunk(req, NULL);
+}
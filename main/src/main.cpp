@@ -5,6 +5,7 @@
 #include "nvs_flash.h"
 
 #include "main_functions.h"
+#include "boot_timeline.h"
 #include "wifi.h"
 
 #ifndef STOCK
@@ -20,26 +21,34 @@ const char *TAG = "main";
 
 extern "C" void app_main() {
 	esp_err_t ret; 
-	
+
+	boot_timeline_init();
+
+	boot_phase_begin(BOOT_PHASE_NVS_INIT);
 	ret = nvs_flash_init();
 	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
 		ESP_ERROR_CHECK(nvs_flash_erase());
 		ret = nvs_flash_init();
 	}
 	ESP_ERROR_CHECK(ret);
+	boot_phase_end(BOOT_PHASE_NVS_INIT);
 
+	boot_phase_begin(BOOT_PHASE_CONNECT_WIFI);
 	ret = connect_wifi();
 	if (WIFI_SUCCESS != ret) {
 		ESP_LOGI(TAG, "Failed to associate to AP, dying...");
 		return;
 	}
+	boot_phase_end(BOOT_PHASE_CONNECT_WIFI);
 
 #ifndef STOCK
+	boot_phase_begin(BOOT_PHASE_AKRI_SERVER_START);
 	ret = akri_server_start();
 	if (ret) {
 		ESP_LOGE(TAG, "Cannot start akri server");
 		abort();
 	}
+	boot_phase_end(BOOT_PHASE_AKRI_SERVER_START);
 	ESP_LOGI(TAG, "HTTP Server started");
 	
 	ret = akri_set_update_handler(ota_request_handler);
@@ -61,12 +70,50 @@ extern "C" void app_main() {
 		ESP_LOGE(TAG, "Cannot set temp handler");
 		abort();
 	}
+
+	ret = akri_set_handler_generic("/pacing", HTTP_GET, pacing_get_handler);
+	if (ret) {
+		ESP_LOGE(TAG, "Cannot set pacing handler");
+		abort();
+	}
+
+	ret = akri_set_handler_generic("/pacing", HTTP_POST, pacing_post_handler);
+	if (ret) {
+		ESP_LOGE(TAG, "Cannot set pacing update handler");
+		abort();
+	}
+	ESP_LOGI(TAG, "Pacing handlers set");
+
+	ret = akri_set_handler_generic("/boot", HTTP_GET, boot_get_handler);
+	if (ret) {
+		ESP_LOGE(TAG, "Cannot set boot timeline handler");
+		abort();
+	}
+	ESP_LOGI(TAG, "Boot timeline handler set");
 #endif
 
 	// Start of the actual application
 	tcp_server_t server;
 	
 	setup(&server);
+
+#ifndef STOCK
+	// Inference is reachable over HTTP as well, once the model is ready
+	ret = akri_set_handler_generic("/infer", HTTP_POST, infer_post_handler);
+	if (ret) {
+		ESP_LOGE(TAG, "Cannot set inference handler");
+		abort();
+	}
+	ESP_LOGI(TAG, "Inference handler set");
+
+	ret = akri_set_handler_generic("/profile", HTTP_GET, profile_get_handler);
+	if (ret) {
+		ESP_LOGE(TAG, "Cannot set profile handler");
+		abort();
+	}
+	ESP_LOGI(TAG, "Profile handler set");
+#endif
+
 	loop(&server);
 
 	close(server.server_fd);
@@ -1,8 +1,15 @@
 #include "main_functions.h"
 
+#include <algorithm>
+#include <atomic>
+
 #include "DataProvider.h"
 #include "PredictionHandler.h"
+#include "InferenceDispatcher.h"
 #include "PredictionInterpreter.h"
+#include "Preprocessor.h"
+#include "OpProfiler.h"
+#include "spsc_ring.h"
 
 #ifndef LOAD_MODEL_FROM_PARTITION
 #include "micro_model.h"
@@ -10,10 +17,22 @@
 
 #include "micro_ops.h"
 
+// Generated along with the offline memory plan embedded in the model, absent for models without one
+#if __has_include("micro_memory_plan.h")
+#include "micro_memory_plan.h"
+static_assert(MICRO_MEMORY_PLAN_SIZE <= TENSOR_ALLOCATION_SPACE,
+			  "The offline memory plan of the model does not fit the tensor arena");
+#endif
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
 
 #include "tensorflow/lite/micro/micro_interpreter.h"
+#include "tensorflow/lite/micro/micro_allocator.h"
+#include "tensorflow/lite/micro/memory_helpers.h"
 #include "tensorflow/lite/micro/micro_log.h"
 #include "tensorflow/lite/schema/schema_generated.h"
 #include "tensorflow/lite/micro/kernels/micro_ops.h"
@@ -22,91 +41,286 @@
 #include "esp_timer.h"
 #include "esp_log.h"
 #include "esp_system.h"
-#include "esp_chip_info.h"
-#include "esp_task_wdt.h"
 
 #include "esp_heap_caps.h"
 
 #ifdef ENABLE_PSRAM 
 #include "esp_psram.h"
+#include "esp_memory_utils.h"
 #endif
 
+#include "nvs.h"
+#include "tensorflow/lite/micro/recording_micro_interpreter.h"
+
 #ifdef LOAD_MODEL_FROM_PARTITION
 #include "esp_partition.h"
 #endif
 
 #include "tcp_server.h"
+#include "udp_server.h"
+#include "pacing.h"
+#include "boot_timeline.h"
+#include "heap_counter.h"
 
-// delay connstant -> 1 sec
-#define pdSECOND pdMS_TO_TICKS(1000)
+#ifndef STOCK
+#include "esp_http_server.h"
+#include "http_server.h"
+#endif
 
 namespace {
 	// Declare ErrorReporter, a TfLite class for error logging
 	tflite::ErrorReporter *error_reporter = nullptr;
 	// Declare the model that will hold the generated C array
 	const tflite::Model *model = nullptr;
+	// Identity of the loaded model, reported to the clients
+	ModelInfo model_info;
 	// Declare interpreter, runs inference using model and data
 	tflite::MicroInterpreter *interpreter = nullptr;
+	// Pool of interpreters sharing the model and the op resolver, the first one is `interpreter`
+	constexpr int kInterpreterCount = INTERPRETER_COUNT;
+	tflite::MicroInterpreter *interpreters[kInterpreterCount] = {};
+	// Interpreters actually built, fewer than kInterpreterCount when their arenas do not fit
+	int interpreter_count = 0;
+	// Per operator latency of every interpreter, merged when exported
+	OpProfiler profilers[kInterpreterCount];
 	
 	// Declare model input and output tensor pointers
 	TfLiteTensor *model_input = nullptr;
 	TfLiteTensor *model_output = nullptr;
 	
-	// Create an area of memory to use for input, output, and intermediate arrays.
-	// the size of this will depend on the model you're using, and may need to be
-	// determined by experimentation.
+	// Arena the requirement of a new model is calibrated in, the largest free block is tried when it is too small
 	constexpr int kTensorArenaSize = (TENSOR_ALLOCATION_SPACE);
-	uint8_t *tensor_arena = nullptr;
+
+	// Arena requirement of the model, calibrated on the first boot and persisted in NVS under the model hash
+	struct ArenaRequirement {
+		uint32_t plan_bytes;
+		uint32_t persistent_bytes;
+	};
+	ArenaRequirement arena_requirement = {};
+	// Set when the requirement was calibrated by this boot
+	bool arena_calibrated = false;
+	constexpr const char* kArenaNamespace = "tensor_arena";
+	// Slack on top of the calibrated requirement
+	constexpr size_t kArenaMargin = 1024;
+
+	// One arena per interpreter of the pool, sized from the requirement
+	uint8_t *tensor_arenas[kInterpreterCount] = {};
+	size_t tensor_arena_sizes[kInterpreterCount] = {};
+	// With PSRAM, the memory plan of the interpreter (activations and scratch buffers, touched by every
+	// inference) is moved to internal RAM when it fits, only the persistent allocations stay in the arena
+	uint8_t *internal_arenas[kInterpreterCount] = {};
+	size_t internal_arena_sizes[kInterpreterCount] = {};
+	// Internal RAM left to WiFi, lwIP and the tasks when placing a memory plan
+	constexpr size_t kInternalHeapReserve = 64 * 1024;
+	// Slack for aligning the start of an arena
+	constexpr size_t kArenaAlignment = 16;
 
 	// Processing pipeline
 	DataProvider data_provider;
 	PredictionInterpreter prediction_interpreter;
 	PredictionHandler prediction_handler;
-}
 
-void PerformWarmup(int warmup_runs) {
-	esp_chip_info_t chip_info;
-	esp_chip_info(&chip_info);
+	// Owns the interpreter once setup is done, every inference goes through it
+	InferenceDispatcher dispatcher;
+	// Inference jobs queued at once, further tagged requests are answered with STATUS_BUSY
+	constexpr int kMaxPendingJobs = MAX_CONNECTIONS;
 
-	uint32_t core_mask = 0;
-	// Set the core mask to include all available cores
-	for (int i = 0; i < chip_info.cores; i++) {
-		core_mask |= (1 << i);
-	}
+	// The servers listen while the model warms up, kModelReady is set once every interpreter is warm
+	EventGroupHandle_t model_state = nullptr;
+	constexpr EventBits_t kModelReady = 1 << 0;
+	// Interpreters still warming up, the last one to finish sets kModelReady
+	std::atomic<int> warmups_left;
+	// Warmup stops once kWarmupStableRuns invokes in a row agree within kWarmupTolerance, or after kMaxWarmupRuns
+	constexpr int kWarmupStableRuns = 3;
+	constexpr float kWarmupTolerance = 0.02f;
+	constexpr int kMaxWarmupRuns = 10;
+
+	// Staging slots per connection: while one sample is invoked, the next one is received or invoked by another
+	// interpreter
+	constexpr int kStagingSlots = 2;
+	constexpr uint8_t kNoSlot = 0xFF;
+
+	// Bytes of a sample received at a time, and receives per readable event, so that
+	// a client streaming large requests leaves room for the other connections
+	constexpr size_t kReceiveChunkSize = 512;
+	constexpr int kReceivesPerEvent = 4;
+	uint8_t receive_chunk[kReceiveChunkSize];
+
+	// Step of the request being received on a connection
+	enum ReceiveState : uint8_t {
+		kReceiveHeader,
+		kReceiveSample,
+		kReceiveSkip,
+	};
+
+	// Statically allocated state of every connection slot of the TCP server
+	struct Connection {
+		int socket;
+		// Input encoding and response format negotiated with the client
+		uint8_t input_encoding;
+		ResponseFormat response;
+		// Frame preprocessing of INPUT_ENCODING_FRAME_UINT8, its tables are built when the client configures it
+		Preprocessor preprocessor;
+		pacing_connection_t pacing;
+
+		uint8_t* slots[kStagingSlots];
+		// Indices of the staging slots that can be filled
+		QueueHandle_t free_slots;
+
+		// The request being received, in pieces as they arrive: the manager never waits for a client
+		ReceiveState state;
+		uint8_t header[DataProvider::kMaxRequestHeaderSize];
+		size_t header_size;
+		size_t header_left;
+		Request request;
+		SampleProgress sample;
+		size_t sample_left;
+		size_t skip_left;
+		// Last time the client sent a byte of the request, or the request stopped waiting for the device
+		int64_t progress_time;
+		// Job of the request, pending while the dispatcher has no room for it
+		InferenceJob job;
+		bool job_pending;
+
+		// Replies queued by the completion task, the manager sends them once the socket is writable
+		SpscByteRing replies;
+		// Room of `replies` not yet promised to a job: a job is queued once the largest reply it can
+		// produce is taken off, the completion task gives back what it did not use and the manager
+		// what it sent, so that queued replies always fit
+		std::atomic<int32_t> reply_credit;
+		// Set by the completion task when the connection has to be closed
+		std::atomic<bool> failed;
+		// Whether replies were waiting to be sent at the last wait for events, and since when no byte was sent
+		bool sending;
+		int64_t send_time;
+	};
 
-	// Increase watchdog timeout to 20 seconds
-	esp_task_wdt_config_t config = {
-		.timeout_ms = 20000,  // Set timeout to 20 sec
-		.idle_core_mask = core_mask,  // Apply to all cores
-		.trigger_panic = false  // Don't trigger panic, just log warning
+	Connection connections[MAX_CONNECTIONS];
+	// Reply being built, shared by the connections as the completion task builds one reply at a time. Reserved at
+	// setup for the largest reply, a batch is built one sample at a time.
+	std::vector<uint8_t> reply_scratch;
+	// Woken up by the completion task once it queued a reply
+	tcp_server_t* tcp_server = nullptr;
+	SemaphoreHandle_t close_done = nullptr;
+
+#ifndef STOCK
+	// The HTTP server runs its handlers one at a time, so a single request is in progress
+	constexpr uint8_t kHttpSource = MAX_CONNECTIONS;
+
+	struct HttpInference {
+		uint8_t* input;
+		DataProvider data_provider;
+		pacing_connection_t pacing;
+		SemaphoreHandle_t done;
+		InferenceResult result;
+		std::vector<uint8_t> reply;
+	};
+
+	HttpInference http_inference;
+
+	// Merged statistics of the profilers, sized at setup
+	std::vector<OpStats> profile_stats;
+#endif
+
+#ifdef UDP_PORT
+	// Datagrams arriving while every slot is in use wait in the receive buffer of the socket
+	struct UdpInference {
+		udp_server_t server;
+		uint8_t source;
+		DataProvider data_provider;
+
+		uint8_t* slots[kStagingSlots];
+		struct sockaddr_in addresses[kStagingSlots];
+		QueueHandle_t free_slots;
+
+		// Datagram being received by the UDP worker, and reply being sent by the dispatcher
+		uint8_t* datagram;
+		size_t datagram_size;
+		uint8_t* reply;
+		uint32_t dropped;
 	};
 
-	esp_task_wdt_reconfigure(&config);
+	UdpInference udp_inference;
+#endif
+}
+
+#ifdef UDP_PORT
+void udp_worker(void *args);
+#endif
+
+bool model_ready() {
+	return xEventGroupGetBits(model_state) & kModelReady;
+}
 
+// Runs the model until the latency of Invoke() settles (instruction and data caches filled, lazy kernel
+// state initialized), at most `max_runs` times. The watchdog is already relaxed by the inference tasks.
+// Returns non-zero when an inference fails.
+int PerformWarmup(tflite::MicroInterpreter* interpreter, int max_runs) {
 	// Fill input tensor with dummy data (ones)
-	memset(model_input->data.raw, 1, model_input->bytes);
-	
-	for (int i = 0; i < warmup_runs; i++) {
+	TfLiteTensor* input = interpreter->input(0);
+	memset(input->data.raw, 1, input->bytes);
+
+	long long latencies[kWarmupStableRuns] = {};
+	int runs = 0;
+	bool stable = false;
+	while (runs < max_runs && !stable) {
+		long long start_time = esp_timer_get_time();
 		if (interpreter->Invoke() != kTfLiteOk) {
-			error_reporter->Report("Warmup inference failed on iteration %d", i + 1);
-			return;
+			error_reporter->Report("Warmup inference failed on iteration %d", runs + 1);
+			return 1;
+		}
+		latencies[runs % kWarmupStableRuns] = esp_timer_get_time() - start_time;
+		runs++;
+
+		if (runs >= kWarmupStableRuns) {
+			long long min_latency = latencies[0], max_latency = latencies[0];
+			for (int i = 1; i < kWarmupStableRuns; i++) {
+				min_latency = latencies[i] < min_latency ? latencies[i] : min_latency;
+				max_latency = latencies[i] > max_latency ? latencies[i] : max_latency;
+			}
+			stable = max_latency - min_latency <= kWarmupTolerance * min_latency;
 		}
 
-		vTaskDelay(0.5 * pdSECOND);
+		// Let the idle task of the core run, so that it keeps feeding the watchdog
+		vTaskDelay(1);
 	}
-	ESP_LOGI("[setup]", "Completed %d warmup runs.", warmup_runs);
 
-	// Restore watchdog timeout to default (5 sec)
-	config.timeout_ms = 5000,  // Restore timeout to 5 sec
-	esp_task_wdt_reconfigure(&config);
+	if (stable) {
+		ESP_LOGI("[setup]", "Warmup converged after %d runs (%lld us per inference).", runs,
+				 latencies[(runs - 1) % kWarmupStableRuns]);
+	} else {
+		ESP_LOGW("[setup]", "Warmup did not converge after %d runs.", runs);
+	}
+	return 0;
+}
+
+// Warms interpreter `args` up next to the servers, on the core and at the priority of its inference task, so that
+// the caches it fills are the ones its inferences run with. The servers answer inference requests with
+// STATUS_WARMING_UP or hold them until every interpreter is done. The inference tasks only pass the jobs without
+// input data through meanwhile, so the interpreters are free. An interpreter failing to run the model leaves it not
+// ready, the servers keep answering STATUS_WARMING_UP rather than running requests on it.
+void warmup_task(void *args) {
+	int index = reinterpret_cast<intptr_t>(args);
+	if (PerformWarmup(interpreters[index], kMaxWarmupRuns)) {
+		ESP_LOGE("[setup]", "Interpreter %d failed to warm up, the model stays not ready", index);
+		vTaskDelete(NULL);
+	}
+
+	if (warmups_left.fetch_sub(1) == 1) {
+		boot_phase_end(BOOT_PHASE_WARMUP);
+		ESP_LOGI("[setup]", "Model ready");
+		xEventGroupSetBits(model_state, kModelReady);
+	}
+	vTaskDelete(NULL);
 }
 
-void allocate_tensor_arena() {
+uint8_t* allocate_tensor_arena(size_t size) {
+	uint8_t *tensor_arena = nullptr;
 #ifndef ENABLE_PSRAM
 	// Allocate tensor arena in internal RAM
-	tensor_arena = (uint8_t *) heap_caps_malloc(kTensorArenaSize, MALLOC_CAP_INTERNAL);
+	tensor_arena = (uint8_t *) heap_caps_malloc(size, MALLOC_CAP_INTERNAL);
 	if (tensor_arena) {
-		ESP_LOGI("allocate_tensor_arena", "Tensor arena allocated in internal RAM (%d bytes)", kTensorArenaSize);
+		ESP_LOGI("allocate_tensor_arena", "Tensor arena allocated in internal RAM (%d bytes)", (int) size);
 	} else {
 		ESP_LOGE("allocate_tensor_arena", "Failed to allocate tensor arena in internal RAM!");
 		vTaskDelete(NULL);
@@ -116,9 +330,9 @@ void allocate_tensor_arena() {
 	if (esp_psram_is_initialized()) {
 		ESP_LOGI("allocate_tensor_arena", "PSRAM is available! Total size: %d bytes", esp_psram_get_size());
 		
-		tensor_arena = (uint8_t *) heap_caps_malloc(kTensorArenaSize, MALLOC_CAP_SPIRAM);
+		tensor_arena = (uint8_t *) heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
 		if (tensor_arena) {
-			ESP_LOGI("allocate_tensor_arena", "Tensor arena allocated in PSRAM (%d bytes)", kTensorArenaSize);
+			ESP_LOGI("allocate_tensor_arena", "Tensor arena allocated in PSRAM (%d bytes)", (int) size);
 		} else {
 			ESP_LOGE("allocate_tensor_arena", "Failed to allocate tensor arena in PSRAM!");
 			vTaskDelete(NULL);
@@ -126,20 +340,233 @@ void allocate_tensor_arena() {
 	} else { // PSRAM is not available -> Try internal RAM
 		ESP_LOGW("allocate_tensor_arena", "PSRAM is NOT available! Trying internal RAM.");
 		
-		tensor_arena = (uint8_t *) heap_caps_malloc(kTensorArenaSize, MALLOC_CAP_INTERNAL);
+		tensor_arena = (uint8_t *) heap_caps_malloc(size, MALLOC_CAP_INTERNAL);
 		if (tensor_arena) {
-			ESP_LOGI("allocate_tensor_arena", "Tensor arena allocated in internal RAM (%d bytes)", kTensorArenaSize);
+			ESP_LOGI("allocate_tensor_arena", "Tensor arena allocated in internal RAM (%d bytes)", (int) size);
 		} else {
 			ESP_LOGE("allocate_tensor_arena", "Failed to allocate tensor arena in internal RAM!");
 			vTaskDelete(NULL);
 		}
 	}
 #endif
-	vTaskDelay(0.5 * pdSECOND);
+	return tensor_arena;
+}
+
+// Memory that allocate_tensor_arena() places a single arena in
+uint32_t tensor_arena_caps() {
+#ifdef ENABLE_PSRAM
+	if (esp_psram_is_initialized()) {
+		return MALLOC_CAP_SPIRAM;
+	}
+#endif
+	return MALLOC_CAP_INTERNAL;
+}
+
+// Whether one more arena of the calibrated size fits, leaving the internal RAM reserved for WiFi, lwIP and the tasks
+bool arena_fits() {
+	size_t required = arena_requirement.plan_bytes + arena_requirement.persistent_bytes + kArenaMargin +
+					  kArenaAlignment;
+	uint32_t caps = tensor_arena_caps();
+	size_t reserve = caps == MALLOC_CAP_INTERNAL ? kInternalHeapReserve : 0;
+	return heap_caps_get_largest_free_block(caps) >= required && heap_caps_get_free_size(caps) >= required + reserve;
+}
+
+void arena_requirement_key(char* key, size_t size) {
+	snprintf(key, size, "%08lx", (unsigned long) model_info.hash);
+}
+
+int load_arena_requirement(ArenaRequirement& requirement) {
+	nvs_handle_t handle;
+	if (nvs_open(kArenaNamespace, NVS_READONLY, &handle) != ESP_OK) {
+		return 1;
+	}
+
+	char key[16];
+	arena_requirement_key(key, sizeof(key));
+	size_t size = sizeof(requirement);
+	esp_err_t err = nvs_get_blob(handle, key, &requirement, &size);
+	nvs_close(handle);
+	return err != ESP_OK || size != sizeof(requirement);
+}
+
+void store_arena_requirement(const ArenaRequirement* requirement) {
+	nvs_handle_t handle;
+	if (nvs_open(kArenaNamespace, NVS_READWRITE, &handle) != ESP_OK) {
+		ESP_LOGW("calibrate_tensor_arena", "Cannot open NVS, the arena will be calibrated again");
+		return;
+	}
+
+	char key[16];
+	arena_requirement_key(key, sizeof(key));
+	esp_err_t err = requirement ? nvs_set_blob(handle, key, requirement, sizeof(*requirement))
+								: nvs_erase_key(handle, key);
+	if (err == ESP_OK) {
+		nvs_commit(handle);
+	}
+	nvs_close(handle);
+}
+
+// Measures the memory plan and the persistent allocations of the model in a generous arena
+int calibrate_tensor_arena(const tflite::MicroOpResolver& op_resolver, ArenaRequirement& requirement) {
+	uint32_t caps = tensor_arena_caps();
+	size_t largest = heap_caps_get_largest_free_block(caps);
+	if (caps == MALLOC_CAP_INTERNAL) {
+		largest = largest > kInternalHeapReserve ? largest - kInternalHeapReserve : 0;
+	}
+
+	size_t sizes[] = {(size_t) kTensorArenaSize, largest};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (i > 0 && sizes[i] <= sizes[0]) {
+			break;
+		}
+
+		uint8_t* arena = (uint8_t *) heap_caps_malloc(sizes[i], caps);
+		if (!arena) {
+			continue;
+		}
+
+		bool allocated;
+		{
+			tflite::RecordingMicroInterpreter probe(model, op_resolver, arena, sizes[i]);
+			allocated = probe.AllocateTensors() == kTfLiteOk;
+			if (allocated) {
+				const tflite::RecordingSingleArenaBufferAllocator* allocator =
+					probe.GetMicroAllocator().GetSimpleMemoryAllocator();
+				requirement.plan_bytes = allocator->GetNonPersistentUsedBytes();
+				requirement.persistent_bytes = allocator->GetPersistentUsedBytes();
+			}
+		}
+		heap_caps_free(arena);
+
+		if (allocated) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Sizes the arenas from the requirement stored for the model, calibrating it on the first boot
+void size_tensor_arena(const tflite::MicroOpResolver& op_resolver) {
+	if (load_arena_requirement(arena_requirement)) {
+		ESP_LOGI("size_tensor_arena", "Calibrating the tensor arena of model %08lx...", (unsigned long) model_info.hash);
+		if (calibrate_tensor_arena(op_resolver, arena_requirement)) {
+			error_reporter->Report("The model does not fit in the available memory");
+			vTaskDelete(NULL);
+		}
+		arena_calibrated = true;
+		store_arena_requirement(&arena_requirement);
+	}
+
+#ifdef MICRO_MEMORY_PLAN_SIZE
+	ESP_LOGI("size_tensor_arena", "Offline memory plan: %d bytes", MICRO_MEMORY_PLAN_SIZE);
+#endif
+	size_t required = arena_requirement.plan_bytes + arena_requirement.persistent_bytes;
+	ESP_LOGI("size_tensor_arena", "Memory plan: %u bytes, persistent allocations: %u bytes (%d bytes spared per interpreter)",
+			 (unsigned) arena_requirement.plan_bytes, (unsigned) arena_requirement.persistent_bytes,
+			 kTensorArenaSize - (int) (required + kArenaMargin));
+}
+
+// Builds interpreter `index` over arenas of the calibrated size. With `split`, the memory plan goes to internal RAM
+// and the persistent allocations to PSRAM. The plan moves as a whole or not at all: TFLite Micro lays every
+// non-persistent buffer out in a single contiguous region, so it cannot be tiered buffer by buffer.
+tflite::MicroInterpreter* build_interpreter(int index, const tflite::MicroOpResolver& op_resolver, bool split) {
+#ifdef ENABLE_PSRAM
+	if (split && esp_psram_is_initialized()) {
+		size_t size = arena_requirement.plan_bytes + kArenaAlignment;
+		if (heap_caps_get_free_size(MALLOC_CAP_INTERNAL) >= size + kInternalHeapReserve) {
+			internal_arenas[index] = (uint8_t *) heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+		}
+
+		if (internal_arenas[index]) {
+			internal_arena_sizes[index] = size;
+			tensor_arena_sizes[index] = arena_requirement.persistent_bytes + kArenaMargin;
+			tensor_arenas[index] = allocate_tensor_arena(tensor_arena_sizes[index]);
+
+			tflite::MicroAllocator* allocator = tflite::MicroAllocator::Create(
+				tensor_arenas[index], tensor_arena_sizes[index], internal_arenas[index], size);
+			if (allocator) {
+				ESP_LOGI("build_interpreter", "Interpreter %d: memory plan in internal RAM (%u bytes)", index,
+						 (unsigned) size);
+				return new tflite::MicroInterpreter(model, op_resolver, allocator, nullptr, &profilers[index]);
+			}
+			heap_caps_free(tensor_arenas[index]);
+		}
+
+		ESP_LOGW("build_interpreter", "Interpreter %d: memory plan (%u bytes) does not fit in internal RAM",
+				 index, (unsigned) size);
+		heap_caps_free(internal_arenas[index]);
+		internal_arenas[index] = nullptr;
+		internal_arena_sizes[index] = 0;
+	}
+#endif
+	tensor_arena_sizes[index] = arena_requirement.plan_bytes + arena_requirement.persistent_bytes + kArenaMargin;
+	tensor_arenas[index] = allocate_tensor_arena(tensor_arena_sizes[index]);
+	return new tflite::MicroInterpreter(model, op_resolver, tensor_arenas[index], tensor_arena_sizes[index],
+										nullptr, &profilers[index]);
+}
+
+// Deletes interpreter `index` and frees its arenas, so that it can be built again
+void release_interpreter(int index) {
+	delete interpreters[index];
+	interpreters[index] = nullptr;
+	heap_caps_free(tensor_arenas[index]);
+	tensor_arenas[index] = nullptr;
+	tensor_arena_sizes[index] = 0;
+	heap_caps_free(internal_arenas[index]);
+	internal_arenas[index] = nullptr;
+	internal_arena_sizes[index] = 0;
+}
+
+// Logs which memory every tensor of the interpreter landed in, weights stay in the model
+void report_tensor_placement(int index) {
+	static const char* const kRegions[] = {"SRAM", "PSRAM", "model"};
+	tflite::MicroInterpreter* instance = interpreters[index];
+	const uint8_t* arena = tensor_arenas[index];
+	const uint8_t* internal_arena = internal_arenas[index];
+#ifdef ENABLE_PSRAM
+	int arena_region = esp_ptr_external_ram(arena) ? 1 : 0;
+#else
+	int arena_region = 0;
+#endif
+
+	size_t totals[3] = {};
+	for (size_t i = 0; i < instance->tensors_size(); i++) {
+		TfLiteEvalTensor* tensor = instance->GetTensor(i);
+		size_t bytes = 0;
+		if (!tensor || !tensor->data.raw || tflite::TfLiteEvalTensorByteLength(tensor, &bytes) != kTfLiteOk) {
+			continue;
+		}
+
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(tensor->data.raw);
+		int region = 2;
+		if (internal_arena && data >= internal_arena && data < internal_arena + internal_arena_sizes[index]) {
+			region = 0;
+		} else if (data >= arena && data < arena + tensor_arena_sizes[index]) {
+			region = arena_region;
+		}
+		totals[region] += bytes;
+
+		if (region != 2) {
+			ESP_LOGI("tensor_placement", "Tensor %u: %u bytes in %s", (unsigned) i, (unsigned) bytes, kRegions[region]);
+		}
+	}
+
+	ESP_LOGI("tensor_placement", "Interpreter %d: %u bytes of tensors in SRAM, %u in PSRAM, %u of weights in the model",
+			 index, (unsigned) totals[0], (unsigned) totals[1], (unsigned) totals[2]);
+}
+
+// FNV-1a hash of the model flatbuffer, used to identify the loaded model
+uint32_t hash_model(const void* model_data, size_t model_size) {
+	const uint8_t* data = static_cast<const uint8_t*>(model_data);
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < model_size; i++) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
 }
 
 #ifdef LOAD_MODEL_FROM_PARTITION
-const tflite::Model* load_model_from_partition() {
+const void* load_model_from_partition() {
 	// Find the partition that contains the model
 	const esp_partition_t* partition = esp_partition_find_first(
 		ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "tflite_model");
@@ -173,7 +600,7 @@ const tflite::Model* load_model_from_partition() {
 	}
 
 	ESP_LOGI("load_model_from_partition", "Model successfully mapped from flash");
-	return tflite::GetModel(model_data);
+	return model_data;
 }
 #endif
 
@@ -181,21 +608,28 @@ void setup(tcp_server_t *server) {
 	static tflite::MicroErrorReporter micro_error_reporter;
 	error_reporter = &micro_error_reporter;
 	
-	// Allocate memory for the tensor arena
-	allocate_tensor_arena();
-
 	// Load the tflite model
+	boot_phase_begin(BOOT_PHASE_GET_MODEL);
 #ifdef LOAD_MODEL_FROM_PARTITION
-	model = load_model_from_partition();
+	const void* model_data = load_model_from_partition();
+	size_t model_size = (TFLITE_MODEL_SIZE);
 #else
-	model = tflite::GetModel(micro_model_cc_data);
+	const void* model_data = micro_model_cc_data;
+	size_t model_size = micro_model_cc_data_len;
 #endif
 
 	// Check if the model is loaded
-	if (!model) {
+	if (!model_data) {
 		error_reporter->Report("Failed to load tflite model");
 		vTaskDelete(NULL);
 	}
+	model = tflite::GetModel(model_data);
+	boot_phase_end(BOOT_PHASE_GET_MODEL);
+
+	model_info.hash = hash_model(model_data, model_size);
+	model_info.size = model_size;
+	ESP_LOGI("setup", "Model %s: %u bytes, hash %08lx", APPLICATION_TYPE,
+			 (unsigned) model_info.size, (unsigned long) model_info.hash);
 
 	// Check if the model is compatible with the TensorFlow Lite interpreter
 	if (model->version() != TFLITE_SCHEMA_VERSION) {
@@ -208,31 +642,159 @@ void setup(tcp_server_t *server) {
 	// Get micro op resolver generated for this model
 	auto* micro_op_resolver = get_micro_op_resolver(error_reporter);
 
-	// Build an interpreter to run the model with.
-	static tflite::MicroInterpreter static_interpreter(
-		model, *micro_op_resolver, tensor_arena, kTensorArenaSize);
-	interpreter = &static_interpreter;
+	// The arena requirement is the same for every interpreter
+	boot_phase_begin(BOOT_PHASE_ARENA_ALLOCATION);
+	size_tensor_arena(*micro_op_resolver);
+	boot_phase_end(BOOT_PHASE_ARENA_ALLOCATION);
 
-	// Allocate tensor buffers
-	TfLiteStatus allocate_status = interpreter->AllocateTensors();
-	if (allocate_status != kTfLiteOk) {
-		error_reporter->Report("AllocateTensors() failed");
-		vTaskDelete(NULL);
+	// Build the interpreters to run the model with, the flatbuffer and the op resolver are shared. The first one is
+	// required, further ones are built while their arenas fit.
+	for (int i = 0; i < kInterpreterCount; i++) {
+		if (i > 0 && !arena_fits()) {
+			ESP_LOGW("setup", "No room for the arena of interpreter %d, running %d interpreters", i, i);
+			break;
+		}
+		if (profilers[i].Init(model)) {
+			error_reporter->Report("Failed to set up the operator profiler");
+			vTaskDelete(NULL);
+		}
+		boot_phase_begin(BOOT_PHASE_ARENA_ALLOCATION);
+		interpreters[i] = build_interpreter(i, *micro_op_resolver, true);
+		boot_phase_end(BOOT_PHASE_ARENA_ALLOCATION);
+
+		// Allocate tensor buffers
+		boot_phase_begin(BOOT_PHASE_ALLOCATE_TENSORS);
+		TfLiteStatus allocate_status = interpreters[i]->AllocateTensors();
+		boot_phase_end(BOOT_PHASE_ALLOCATE_TENSORS);
+
+		// Arenas split across memories are a tighter fit than a single one, fall back to a single arena first
+		if (allocate_status != kTfLiteOk && internal_arenas[i]) {
+			ESP_LOGW("setup", "Interpreter %d: AllocateTensors() failed on split arenas, retrying with a single arena", i);
+			boot_phase_begin(BOOT_PHASE_ARENA_ALLOCATION);
+			release_interpreter(i);
+			interpreters[i] = build_interpreter(i, *micro_op_resolver, false);
+			boot_phase_end(BOOT_PHASE_ARENA_ALLOCATION);
+
+			boot_phase_begin(BOOT_PHASE_ALLOCATE_TENSORS);
+			allocate_status = interpreters[i]->AllocateTensors();
+			boot_phase_end(BOOT_PHASE_ALLOCATE_TENSORS);
+		}
+		if (allocate_status != kTfLiteOk && i > 0) {
+			// The requirement held for the first interpreter, only the memory for this one is missing
+			ESP_LOGW("setup", "Interpreter %d: AllocateTensors() failed, running %d interpreters", i, i);
+			release_interpreter(i);
+			break;
+		}
+		if (allocate_status != kTfLiteOk) {
+			error_reporter->Report("AllocateTensors() failed");
+			// A requirement calibrated by another firmware may no longer hold, calibrate it again
+			if (!arena_calibrated) {
+				store_arena_requirement(nullptr);
+				esp_restart();
+			}
+			vTaskDelete(NULL);
+		}
+		interpreter_count++;
 	}
+	interpreter = interpreters[0];
 
 	// Show the memory usage of the model
-	ESP_LOGI("setup", "Used tensor arena: %d bytes", interpreter->arena_used_bytes());
+	ESP_LOGI("setup", "Used tensor arena: %d bytes (%d interpreters)", interpreter->arena_used_bytes(),
+			 interpreter_count);
+	report_tensor_placement(0);
 
 	// Get pointers to the input and output tensors
 	model_input = interpreter->input(0);
 	model_output = interpreter->output(0);
 
-	// Perform warmup runs before measuring inference time
+	pacing_init();
+
+	// Size the buffers of the request path from the tensors, requests allocate nothing from now on
+	size_t score_count = prediction_interpreter.GetScoreCount(model_output);
+	prediction_handler.Init(score_count, model_input, model_output);
+	data_provider.Init(model_input);
+
+	reply_scratch.reserve(prediction_handler.ReplyCapacity());
+	// Allocate the staging slots of every connection once, so that memory stays flat as clients come and go
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		connections[i].free_slots = xQueueCreate(kStagingSlots, sizeof(uint8_t));
+		for (int j = 0; j < kStagingSlots; j++) {
+			connections[i].slots[j] = new uint8_t[model_input->bytes];
+		}
+		// Room for the replies of every job a connection can have queued, one per staging slot and a control
+		// request, while the socket is not writable
+		if (!connections[i].replies.Init((kStagingSlots + 1) * prediction_handler.ReplyCapacity())) {
+			error_reporter->Report("Failed to allocate the reply buffers");
+			vTaskDelete(NULL);
+		}
+	}
+
+	// Every TCP connection is a request source of its own, followed by the HTTP server
+	int source_count = MAX_CONNECTIONS;
+	close_done = xSemaphoreCreateBinary();
+
+#ifndef STOCK
+	http_inference.input = new uint8_t[model_input->bytes];
+	http_inference.data_provider.Init(model_input);
+	http_inference.done = xSemaphoreCreateBinary();
+	http_inference.result.prediction.reserve(score_count);
+	http_inference.reply.reserve(score_count * sizeof(float) + sizeof(long long));
+	pacing_connection_init(&http_inference.pacing);
+	source_count++;
+
+	profile_stats.resize(profilers[0].GetOpCount());
+#endif
+
+#ifdef UDP_PORT
+	// Every buffer of the UDP path is allocated here, requests allocate nothing.
+	// One more byte than the largest request is received, so that oversized ones are detected.
+	udp_inference.datagram_size = UDP_REQUEST_HEADER_SIZE +
+								  data_provider.EncodedSize(model_input, INPUT_ENCODING_FLOAT32) + 1;
+	udp_inference.datagram = new uint8_t[udp_inference.datagram_size];
+	udp_inference.data_provider.Init(model_input);
+	udp_inference.reply = new uint8_t[UDP_REPLY_HEADER_SIZE + model_output->bytes * sizeof(float) +
+									  sizeof(long long)];
+	udp_inference.free_slots = xQueueCreate(kStagingSlots, sizeof(uint8_t));
+	for (uint8_t i = 0; i < kStagingSlots; i++) {
+		udp_inference.slots[i] = new uint8_t[model_input->bytes];
+		xQueueSend(udp_inference.free_slots, &i, 0);
+	}
+	udp_inference.source = source_count++;
+#endif
+
+	if (dispatcher.Init(interpreters, profilers, interpreter_count, source_count, kMaxPendingJobs) || dispatcher.Start()) {
+		error_reporter->Report("Failed to start the inference dispatcher");
+		vTaskDelete(NULL);
+	}
+
+	// Warm every interpreter up on its inference core while the servers already accept clients
 	ESP_LOGI("setup", "Performing warmup runs...");
-	int warmup_runs = 10;
-	PerformWarmup(warmup_runs);
+	model_state = xEventGroupCreate();
+	if (!model_state) {
+		error_reporter->Report("Failed to start the warmup");
+		vTaskDelete(NULL);
+	}
+	warmups_left.store(interpreter_count);
+	boot_phase_begin(BOOT_PHASE_WARMUP);
+	for (int i = 0; i < interpreter_count; i++) {
+		if (xTaskCreatePinnedToCore(warmup_task, "warmup", 4096, reinterpret_cast<void*>(i),
+									InferenceDispatcher::WorkerPriority(i), NULL,
+									InferenceDispatcher::WorkerCore(i)) != pdPASS) {
+			error_reporter->Report("Failed to start the warmup");
+			vTaskDelete(NULL);
+		}
+	}
+
+#ifdef UDP_PORT
+	if (udp_server_init(&udp_inference.server, UDP_PORT) ||
+		xTaskCreatePinnedToCore(udp_worker, "udp_worker", 4096, NULL, 5, NULL, InferenceDispatcher::kIoCore) != pdPASS) {
+		error_reporter->Report("Failed to start the UDP server");
+		vTaskDelete(NULL);
+	}
+#endif
 
 	// Initialize the ESP32 server
+	tcp_server = server;
 	int err = tcp_server_init(server);
 	if (err  == -1) {
 		error_reporter->Report("Failed to Start Server");
@@ -240,74 +802,669 @@ void setup(tcp_server_t *server) {
 	}
 }
 
-void handle_client(void *args) {
-	int client_socket = (int)args;
-	esp_chip_info_t chip_info;
-	esp_chip_info(&chip_info);
-
-	uint32_t core_mask = 0;
-	// Set the core mask to include all available cores
-	for (int i = 0; i < chip_info.cores; i++) {
-		core_mask |= (1 << i);
+// Counts the heap allocations of the calling task on a request path, the socket calls themselves are left out
+void track_allocations(const char* path) {
+	if (heap_counter_track_task()) {
+		ESP_LOGW(path, "The heap allocations of this task are not counted");
 	}
+}
 
-	// Increase watchdog timeout to 20 seconds
-	esp_task_wdt_config_t config = {
-		.timeout_ms = 20000,  // Set timeout to 20 sec
-		.idle_core_mask = core_mask,  // Apply to all cores
-		.trigger_panic = false  // Don't trigger panic, just log warning
-	};
+// Warns when the calling task allocated since it read `allocations`, steady state requests allocate nothing
+void check_allocations(const char* path, uint32_t allocations) {
+	allocations = heap_allocation_count() - allocations;
+	if (allocations) {
+		ESP_LOGW(path, "Request allocated %lu times on the heap", (unsigned long) allocations);
+	}
+}
 
-	esp_task_wdt_reconfigure(&config);
+// Builds the reply of a connection job in `reply_scratch`, returns non-zero when the connection has to be closed
+int BuildReply(const InferenceJob& job, InferenceResult& result) {
+	std::vector<uint8_t>& reply = reply_scratch;
 
-	while(1) {
-		// Read test data and copy them to the model input tensor
-		if (data_provider.Read(client_socket, model_input)) {
+	switch (job.type) {
+		case REQUEST_INFO:
+			prediction_handler.BuildInfo(reply, model_info, model_input, model_output,
+										 data_provider.SupportedEncodings(model_input));
+			return 0;
+		case REQUEST_SET_ENCODING:
+		case REQUEST_SET_RESPONSE:
+		case REQUEST_SET_PREPROCESS:
+			prediction_handler.BuildStatus(reply, job.status);
+			return 0;
+		default:
 			break;
+	}
+
+	// Every inference job carries the response format of the time it was requested
+	ResponseFormat format = {job.response_mode, job.top_k, job.threshold};
+
+	switch (job.type) {
+		case REQUEST_INFER_TAGGED:
+			// Busy requests were never run, their status comes with the job
+			if (!job.input) {
+				result.status = job.status;
+			}
+			prediction_handler.BuildTagged(reply, job.request_id, result.status, format, result.prediction,
+										   result.output, result.inference_time);
+			return 0;
+		case REQUEST_INFER_BATCH:
+			if (result.status != STATUS_OK) {
+				return 1;
+			}
+			// The samples of a batch are queued as they complete, the client reads them as one reply
+			prediction_handler.BuildBatchSample(reply, job.batch_index, job.batch_size, result.prediction,
+												result.inference_time);
+			return 0;
+		default:
+			if (result.status != STATUS_OK) {
+				return 1;
+			}
+			prediction_handler.BuildResult(reply, format, result.prediction, result.output, result.inference_time);
+			return 0;
+	}
+}
+
+// Completes a connection job on the completion task: its reply is queued, never sent from here
+void complete_job(const InferenceJob& job, InferenceResult& result) {
+	Connection& conn = connections[job.source];
+	int err = BuildReply(job, result);
+	size_t written = 0;
+
+	// The credit reserved room for MaxReplySize(), a reply outgrowing it breaks the connection instead of the ring
+	if (!err && conn.replies.Write(reply_scratch.data(), reply_scratch.size())) {
+		written = reply_scratch.size();
+	} else if (!err) {
+		ESP_LOGE("complete_job", "Reply of %u bytes does not fit the reply buffer", (unsigned) reply_scratch.size());
+		err = 1;
+	}
+	conn.reply_credit.fetch_add(prediction_handler.MaxReplySize(job.type, job.batch_index) - written);
+
+	if (job.slot != kNoSlot) {
+		xQueueSend(conn.free_slots, &job.slot, portMAX_DELAY);
+	}
+
+	// Wake the connection manager up, so that it sends the reply or closes the broken connection
+	if (err) {
+		conn.failed.store(true);
+	}
+	tcp_server_wake(tcp_server);
+}
+
+// Completes once every job queued before it for the connection has completed
+void complete_close(const InferenceJob& job, InferenceResult& result) {
+	xSemaphoreGive(close_done);
+}
+
+// Gets the connection ready for the header of its next request
+void StartHeader(Connection& conn) {
+	conn.state = kReceiveHeader;
+	conn.header_size = 0;
+	conn.header_left = 1;
+}
+
+// Starts receiving sample `job.batch_index` of the request, it waits for a staging slot first
+void StartSample(Connection& conn) {
+	conn.state = kReceiveSample;
+	conn.job.slot = kNoSlot;
+	conn.job.input = nullptr;
+	if (conn.input_encoding == INPUT_ENCODING_FRAME_UINT8) {
+		conn.sample_left = conn.preprocessor.FrameSize();
+		conn.preprocessor.Begin();
+	} else {
+		conn.sample_left = data_provider.EncodedSize(model_input, conn.input_encoding);
+		data_provider.Begin(conn.sample, conn.input_encoding);
+	}
+}
+
+// Moves on once the job of the connection is queued: to the next sample of the request, or to the next request
+void AdvanceRequest(Connection& conn) {
+	conn.job_pending = false;
+	conn.progress_time = esp_timer_get_time();
+
+	if (conn.job.batch_index + 1 < conn.request.sample_count) {
+		conn.job.batch_index++;
+		StartSample(conn);
+	} else if (conn.request.skip) {
+		conn.state = kReceiveSkip;
+		conn.skip_left = conn.request.skip;
+	} else {
+		StartHeader(conn);
+	}
+}
+
+// Hands the job of the connection to the dispatcher without waiting for it. Returns false, with the
+// job left pending, while the dispatcher has no room for it: the connection is parked until it does.
+bool QueueJob(Connection& conn) {
+	InferenceJob& job = conn.job;
+
+	// The reply must fit the replies the client has not read yet, a client that stops reading stops being read
+	int32_t reply_size = prediction_handler.MaxReplySize(job.type, job.batch_index);
+	// Untagged replies have no status to report the warmup with either, their samples wait for the model
+	if (job.input && !model_ready()) {
+		conn.job_pending = true;
+		return false;
+	}
+	if (conn.reply_credit.load() < reply_size || !dispatcher.CanQueue(job.source)) {
+		conn.job_pending = true;
+		return false;
+	}
+	conn.reply_credit.fetch_sub(reply_size);
+	if (!dispatcher.Submit(job, false)) {
+		// Untagged replies have no status to report a full queue with, they wait for room instead
+		if (job.type != REQUEST_INFER_TAGGED) {
+			conn.reply_credit.fetch_add(reply_size);
+			conn.job_pending = true;
+			return false;
 		}
 
-		// Run inference on pre-processed data
-		long long start_time = esp_timer_get_time();
+		xQueueSend(conn.free_slots, &job.slot, 0);
+		job.input = nullptr;
+		job.slot = kNoSlot;
+		job.status = STATUS_BUSY;
+		dispatcher.Submit(job, false);
+	}
+
+	AdvanceRequest(conn);
+	return true;
+}
 
-		TfLiteStatus invoke_status = interpreter->Invoke();
-		if (invoke_status != kTfLiteOk) {
-			error_reporter->Report("Invoke failed");
+// Acts on a complete request header, returns non-zero to close the connection
+int StartRequest(int id, Connection& conn) {
+	const Request& request = conn.request;
+	InferenceJob& job = conn.job;
+
+	job = {};
+	job.source = id;
+	job.complete = complete_job;
+	job.type = request.type;
+	job.slot = kNoSlot;
+	job.request_id = request.request_id;
+
+	switch (request.type) {
+		case REQUEST_INFO:
+			break;
+		case REQUEST_SET_ENCODING:
+			// The encoding applies to the very next request, only the reply goes through the dispatcher
+			job.status = STATUS_UNSUPPORTED;
+			if (data_provider.SupportsEncoding(model_input, request.input_encoding)) {
+				conn.input_encoding = request.input_encoding;
+				job.status = STATUS_OK;
+			} else {
+				ESP_LOGW("tcp_server", "Unsupported input encoding: %d", request.input_encoding);
+			}
+			break;
+		case REQUEST_SET_RESPONSE: {
+			ResponseFormat format = {request.response_mode, request.top_k, request.threshold};
+			job.status = STATUS_UNSUPPORTED;
+			if (prediction_handler.SupportsResponse(format, model_output)) {
+				conn.response = format;
+				job.status = STATUS_OK;
+			} else {
+				ESP_LOGW("tcp_server", "Unsupported response mode: %d", request.response_mode);
+			}
 			break;
 		}
+		case REQUEST_SET_PREPROCESS:
+			job.status = STATUS_UNSUPPORTED;
+			if (!conn.preprocessor.Configure(request.preprocess, model_input)) {
+				conn.input_encoding = INPUT_ENCODING_FRAME_UINT8;
+				job.status = STATUS_OK;
+			} else if (conn.input_encoding == INPUT_ENCODING_FRAME_UINT8 && !conn.preprocessor.IsConfigured()) {
+				// A rejected configuration keeps the accepted one, frames are only read with a configuration
+				conn.input_encoding = INPUT_ENCODING_FLOAT32;
+			}
+			break;
+		default:
+			if (conn.input_encoding != INPUT_ENCODING_FRAME_UINT8 &&
+				!data_provider.SupportsEncoding(model_input, conn.input_encoding)) {
+				ESP_LOGE("tcp_server", "Input tensor type is not supported: %d", model_input->type);
+				return 1;
+			}
 
-		long long inference_time = esp_timer_get_time() - start_time;
+			pacing_connection_charge(&conn.pacing, request.sample_count);
 
-		// Interpret raw model predictions
-		auto prediction = prediction_interpreter.GetResult(model_output, 0.0);
+			job.response_mode = conn.response.mode;
+			job.top_k = conn.response.top_k;
+			job.threshold = conn.response.threshold;
+			job.batch_size = request.sample_count;
+			job.batch_index = 0;
+			StartSample(conn);
+			return 0;
+	}
 
-		// Send the inference result to the client
-		if (prediction_handler.Update(client_socket, prediction, inference_time)) {
-			break;
+	QueueJob(conn);
+	return 0;
+}
+
+// Queues the sample that was received in full into its staging slot
+void EndSample(Connection& conn) {
+	InferenceJob& job = conn.job;
+	job.input = conn.slots[job.slot];
+
+	// Tagged requests that arrive during the warmup are answered right away, once read
+	if (job.type == REQUEST_INFER_TAGGED && !model_ready()) {
+		xQueueSend(conn.free_slots, &job.slot, 0);
+		job.input = nullptr;
+		job.slot = kNoSlot;
+		job.status = STATUS_WARMING_UP;
+	}
+	QueueJob(conn);
+}
+
+// Uses the bytes received for the current step of the request, returns non-zero to close the connection
+int Consume(int id, Connection& conn, const uint8_t* data, size_t size) {
+	conn.progress_time = esp_timer_get_time();
+
+	switch (conn.state) {
+		case kReceiveHeader: {
+			conn.header_size += size;
+			int missing = data_provider.ParseRequest(conn.header, conn.header_size, conn.request);
+			if (missing < 0) {
+				return 1;
+			}
+			conn.header_left = missing;
+			return missing ? 0 : StartRequest(id, conn);
+		}
+		case kReceiveSample: {
+			uint8_t* slot = conn.slots[conn.job.slot];
+			if (conn.input_encoding == INPUT_ENCODING_FRAME_UINT8) {
+				conn.preprocessor.Feed(data, size, slot);
+			} else {
+				data_provider.Decode(conn.sample, data, size, model_input, slot);
+			}
+			conn.sample_left -= size;
+			if (!conn.sample_left) {
+				EndSample(conn);
+			}
+			return 0;
 		}
+		case kReceiveSkip:
+			conn.skip_left -= size;
+			if (!conn.skip_left) {
+				StartHeader(conn);
+			}
+			return 0;
+	}
+	return 0;
+}
+
+int on_open(int id, int client_socket) {
+	Connection& conn = connections[id];
+	conn.socket = client_socket;
+	conn.input_encoding = INPUT_ENCODING_FLOAT32;
+	conn.response = {RESPONSE_FULL, 0, 0.0f};
+	pacing_connection_init(&conn.pacing);
+	conn.job_pending = false;
+	StartHeader(conn);
 
-		vTaskDelay(0.5 * pdSECOND);
+	conn.replies.Reset();
+	conn.reply_credit.store(conn.replies.Capacity());
+	conn.failed.store(false);
+	conn.sending = false;
+
+	xQueueReset(conn.free_slots);
+	for (uint8_t i = 0; i < kStagingSlots; i++) {
+		xQueueSend(conn.free_slots, &i, 0);
 	}
+	return 0;
+}
 
-	// Restore watchdog timeout to default (5 sec)
-	config.timeout_ms = 5000,  // Restore timeout to 5 sec
-	esp_task_wdt_reconfigure(&config);
- 
-	close(client_socket);
-	vTaskDelete(NULL);
+// A connection is parked, not read from, while its job waits for the warmup, for room in the dispatcher or for room
+// for its reply, or its next sample for a staging slot, and between requests once it has spent its pacing budget. Parked
+// connections are retried at every poll of the server, a request that stalls on the client for TCP_IO_TIMEOUT_MS
+// closes the connection, and so does a client that reads none of its replies for as long.
+int wants_read(int id) {
+	Connection& conn = connections[id];
+	int64_t now = esp_timer_get_time();
+
+	if (conn.failed.load()) {
+		return -1;
+	}
+	if (conn.sending && now - conn.send_time > TCP_IO_TIMEOUT_MS * 1000LL) {
+		ESP_LOGE("tcp_server", "Replies stalled for %d ms, closing the connection", TCP_IO_TIMEOUT_MS);
+		return -1;
+	}
+	if (conn.job_pending && !QueueJob(conn)) {
+		conn.progress_time = now;
+		return 0;
+	}
+	if (conn.state == kReceiveSample && conn.job.slot == kNoSlot && !uxQueueMessagesWaiting(conn.free_slots)) {
+		conn.progress_time = now;
+		return 0;
+	}
+	if (conn.state == kReceiveHeader && conn.header_size == 0) {
+		return pacing_connection_delay(&conn.pacing) == 0;
+	}
+
+	if (now - conn.progress_time > TCP_IO_TIMEOUT_MS * 1000LL) {
+		ESP_LOGE("tcp_server", "Request stalled for %d ms, closing the connection", TCP_IO_TIMEOUT_MS);
+		return -1;
+	}
+	return 1;
 }
 
-void loop(tcp_server_t *server) {
-	const char *TAG = "tcp_server";
+// Receives what the socket has for the request in progress, the state of the connection carries over to the
+// next event. Reading stops early when the request cannot make progress, see wants_read().
+int on_readable(int id, int client_socket) {
+	Connection& conn = connections[id];
+
+	for (int i = 0; i < kReceivesPerEvent; i++) {
+		if (conn.job_pending) {
+			return 0;
+		}
+
+		// Never more than the current step of the request, which decides what the bytes are
+		uint8_t* buffer = receive_chunk;
+		size_t size = 0;
+		switch (conn.state) {
+			case kReceiveHeader:
+				buffer = conn.header + conn.header_size;
+				size = conn.header_left;
+				break;
+			case kReceiveSample:
+				if (conn.job.slot == kNoSlot && xQueueReceive(conn.free_slots, &conn.job.slot, 0) != pdTRUE) {
+					return 0;
+				}
+				size = std::min(conn.sample_left, kReceiveChunkSize);
+				break;
+			case kReceiveSkip:
+				size = std::min(conn.skip_left, kReceiveChunkSize);
+				break;
+		}
+
+		ssize_t received = tcp_server_read(client_socket, buffer, size);
+		if (received <= 0) {
+			return received < 0;
+		}
+		uint32_t allocations = heap_allocation_count();
+		int err = Consume(id, conn, buffer, received);
+		check_allocations("tcp_server", allocations);
+		if (err) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int wants_write(int id) {
+	Connection& conn = connections[id];
+	bool sending = !conn.replies.Empty();
+
+	if (sending && !conn.sending) {
+		conn.send_time = esp_timer_get_time();
+	}
+	conn.sending = sending;
+	return sending;
+}
+
+// Sends the queued replies as far as the socket takes them, the rest waits for the next writable event
+int on_writable(int id, int client_socket) {
+	Connection& conn = connections[id];
+	const uint8_t* data;
+	size_t size;
+
+	while ((size = conn.replies.Peek(&data)) > 0) {
+		ssize_t sent = tcp_server_write(client_socket, data, size);
+		if (sent < 0) {
+			return 1;
+		}
+		if (sent == 0) {
+			return 0;
+		}
+		conn.replies.Consume(sent);
+		conn.reply_credit.fetch_add(sent);
+		conn.send_time = esp_timer_get_time();
+	}
+	return 0;
+}
+
+// Waits for the jobs of the connection to complete, so that no reply is sent to a reused socket
+void on_close(int id, int client_socket) {
+	InferenceJob job = {};
+	job.source = id;
+	job.complete = complete_close;
+
+	dispatcher.Submit(job, true);
+	xSemaphoreTake(close_done, portMAX_DELAY);
+}
+
+#ifdef UDP_PORT
+// Sends the reply datagram of a UDP request, on the completion task
+void complete_udp(const InferenceJob& job, InferenceResult& result) {
+	uint8_t* reply = udp_inference.reply;
+	uint8_t status = job.input ? result.status : job.status;
+
+	memcpy(reply, &job.request_id, sizeof(job.request_id));
+	reply[sizeof(job.request_id)] = status;
+	size_t size = UDP_REPLY_HEADER_SIZE;
+
+	if (status == STATUS_OK) {
+		memcpy(reply + size, result.prediction.data(), result.prediction.size() * sizeof(float));
+		size += result.prediction.size() * sizeof(float);
+		memcpy(reply + size, &result.inference_time, sizeof(result.inference_time));
+		size += sizeof(result.inference_time);
+	}
+
+	udp_server_send(&udp_inference.server, reply, size, &udp_inference.addresses[job.slot]);
+	xQueueSend(udp_inference.free_slots, &job.slot, portMAX_DELAY);
+}
+
+// Receives one request per datagram into a free staging slot and hands it to the dispatcher
+void udp_worker(void *args) {
+	InferenceJob job = {};
+	job.source = udp_inference.source;
+	job.complete = complete_udp;
+	track_allocations("udp_server");
+
 	while (1) {
-		ESP_LOGI(TAG, "Waiting for client connection...");
-		int client_socket = tcp_server_accept(server);
-		if (client_socket < 0) {
-			ESP_LOGE(TAG, "Failed to accept client connection");
+		xQueueReceive(udp_inference.free_slots, &job.slot, portMAX_DELAY);
+
+		const uint8_t* datagram = udp_inference.datagram;
+		ssize_t size = udp_server_receive(&udp_inference.server, udp_inference.datagram,
+										  udp_inference.datagram_size, &udp_inference.addresses[job.slot]);
+		uint32_t allocations = heap_allocation_count();
+
+		uint8_t encoding = size >= UDP_REQUEST_HEADER_SIZE ? datagram[sizeof(job.request_id)] : INPUT_ENCODING_COUNT;
+		if (!udp_inference.data_provider.SupportsEncoding(model_input, encoding) ||
+			udp_inference.data_provider.Read(datagram + UDP_REQUEST_HEADER_SIZE, size - UDP_REQUEST_HEADER_SIZE,
+											 model_input, encoding, udp_inference.slots[job.slot])) {
+			ESP_LOGW("udp_server", "Dropped malformed datagram of %d bytes (%lu dropped)", (int) size,
+					 (unsigned long) ++udp_inference.dropped);
+			xQueueSend(udp_inference.free_slots, &job.slot, portMAX_DELAY);
+			continue;
+		}
+
+		memcpy(&job.request_id, datagram, sizeof(job.request_id));
+		job.input = udp_inference.slots[job.slot];
+		bool ready = model_ready();
+		bool queued = ready && dispatcher.Submit(job, false);
+		check_allocations("udp_server", allocations);
+		if (queued) {
 			continue;
 		}
 
-		// Handle the client connection in a separate task
-		ESP_LOGI(TAG, "New client connected");
-		xTaskCreate(handle_client, "handle_client", 4096, (void *)client_socket, 5, NULL);
+		// The model is warming up or the queue is full, the request is answered right away and its slot is reused
+		uint8_t busy[UDP_REPLY_HEADER_SIZE];
+		memcpy(busy, &job.request_id, sizeof(job.request_id));
+		busy[sizeof(job.request_id)] = ready ? STATUS_BUSY : STATUS_WARMING_UP;
+		udp_server_send(&udp_inference.server, busy, sizeof(busy), &udp_inference.addresses[job.slot]);
+		xQueueSend(udp_inference.free_slots, &job.slot, portMAX_DELAY);
+	}
+}
+#endif
+
+#ifndef STOCK
+void complete_http(const InferenceJob& job, InferenceResult& result) {
+	// Copied into storage reserved at setup, the result of the dispatcher is reused by the next job
+	http_inference.result = result;
+	xSemaphoreGive(http_inference.done);
+}
+
+static ssize_t http_receive(void* context, void* buffer, size_t size) {
+	httpd_req_t* req = static_cast<httpd_req_t*>(context);
+	size_t total_size = 0;
+	while (total_size < size) {
+		int ret = httpd_req_recv(req, static_cast<char*>(buffer) + total_size, size - total_size);
+		if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+			continue;
+		}
+		if (ret <= 0) {
+			return -1;
+		}
+		total_size += ret;
+	}
+	return total_size;
+}
+
+// Reads and drops the rest of the request body, so that the connection stays usable for the next request
+static esp_err_t http_discard_body(httpd_req_t *req) {
+	char buffer[64];
+	int ret;
+	while ((ret = httpd_req_recv(req, buffer, sizeof(buffer))) != 0) {
+		if (ret < 0 && ret != HTTPD_SOCK_ERR_TIMEOUT) {
+			return ESP_FAIL;
+		}
+	}
+	return ESP_OK;
+}
+
+static esp_err_t http_send_status(httpd_req_t *req, const char *status, const char *message) {
+	httpd_resp_set_status(req, status);
+	httpd_resp_set_type(req, "text/plain");
+	return httpd_resp_send(req, message, HTTPD_RESP_USE_STRLEN);
+}
+
+// Runs inference on the input tensor sent as the request body, e.g.
+// POST /infer?encoding=int8 (float32 by default, int8, uint8 or pixel, see INPUT_ENCODING_*)
+// and replies with [scores (float32 x N)][inference time (int64, us)], like REQUEST_INFER.
+// The body is consumed on every reply, also the refusals, so the connection is kept alive for the next request.
+// A body that cannot be read closes the connection.
+esp_err_t infer_post_handler(httpd_req_t *req) {
+	static const char* const encoding_names[INPUT_ENCODING_COUNT] = {"float32", "int8", "uint8", "pixel", "frame"};
+	// Every handler runs on the single task of the HTTP server
+	static bool tracked = false;
+	if (!tracked) {
+		track_allocations("http_server");
+		tracked = true;
+	}
+
+	uint8_t encoding = INPUT_ENCODING_FLOAT32;
+	char query[32], name[16];
+	if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+		httpd_query_key_value(query, "encoding", name, sizeof(name)) == ESP_OK) {
+		encoding = INPUT_ENCODING_COUNT;
+		for (uint8_t i = 0; i < INPUT_ENCODING_COUNT; i++) {
+			if (strcmp(name, encoding_names[i]) == 0) {
+				encoding = i;
+			}
+		}
+	}
+
+	// Requests refused before their body is read drop it first, a body that cannot be read closes the connection
+	if (!http_inference.data_provider.SupportsEncoding(model_input, encoding)) {
+		if (http_discard_body(req) != ESP_OK) {
+			return ESP_FAIL;
+		}
+		return http_send_status(req, "415 Unsupported Media Type", "Unsupported input encoding");
+	}
+	if (req->content_len != http_inference.data_provider.EncodedSize(model_input, encoding)) {
+		if (http_discard_body(req) != ESP_OK) {
+			return ESP_FAIL;
+		}
+		return http_send_status(req, "400 Bad Request", "Body does not match the input tensor size");
+	}
+	if (pacing_connection_delay(&http_inference.pacing) > 0) {
+		if (http_discard_body(req) != ESP_OK) {
+			return ESP_FAIL;
+		}
+		httpd_resp_set_hdr(req, "Retry-After", "1");
+		return http_send_status(req, "429 Too Many Requests", "Request rate limit exceeded");
+	}
+
+	InputSource source = {req, http_receive};
+	if (http_inference.data_provider.Read(source, model_input, encoding, http_inference.input)) {
+		return ESP_FAIL;
+	}
+	if (!model_ready()) {
+		httpd_resp_set_hdr(req, "Retry-After", "1");
+		return http_send_status(req, "503 Service Unavailable", "Model is warming up");
 	}
+	pacing_connection_charge(&http_inference.pacing, 1);
+	uint32_t allocations = heap_allocation_count();
+
+	InferenceJob job = {};
+	job.source = kHttpSource;
+	job.input = http_inference.input;
+	job.complete = complete_http;
+
+	if (!dispatcher.Submit(job, false)) {
+		httpd_resp_set_hdr(req, "Retry-After", "1");
+		return http_send_status(req, "503 Service Unavailable", "Inference queue is full");
+	}
+	xSemaphoreTake(http_inference.done, portMAX_DELAY);
+
+	InferenceResult& result = http_inference.result;
+	if (result.status != STATUS_OK) {
+		return http_send_status(req, "500 Internal Server Error", "Inference failed");
+	}
+
+	std::vector<uint8_t>& reply = http_inference.reply;
+	reply.resize(result.prediction.size() * sizeof(float) + sizeof(result.inference_time));
+	memcpy(reply.data(), result.prediction.data(), result.prediction.size() * sizeof(float));
+	memcpy(reply.data() + result.prediction.size() * sizeof(float), &result.inference_time,
+		   sizeof(result.inference_time));
+	check_allocations("http_server", allocations);
+
+	httpd_resp_set_type(req, "application/octet-stream");
+	return httpd_resp_send(req, reinterpret_cast<const char*>(reply.data()), reply.size());
+}
+
+// Per operator latency over the rolling window of every interpreter, sent as one JSON chunk per operator
+esp_err_t profile_get_handler(httpd_req_t *req) {
+	float invoke_us = 0;
+	for (size_t op = 0; op < profile_stats.size(); op++) {
+		OpStats& stats = profile_stats[op];
+		stats = {};
+		for (int i = 0; i < interpreter_count; i++) {
+			profilers[i].GetStats(op, stats);
+		}
+		invoke_us += stats.mean_us;
+	}
+
+	char chunk[192];
+	httpd_resp_set_type(req, "application/json");
+	snprintf(chunk, sizeof(chunk), "{\"interpreters\":%d,\"window\":%d,\"invoke_us\":%.1f,\"ops\":[",
+			 interpreter_count, OpProfiler::kWindow - 1, invoke_us);
+	httpd_resp_sendstr_chunk(req, chunk);
+
+	for (size_t op = 0; op < profile_stats.size(); op++) {
+		const OpStats& stats = profile_stats[op];
+		httpd_resp_sendstr_chunk(req, op ? ",{" : "{");
+		httpd_resp_sendstr_chunk(req, profilers[0].GetOpInfo(op).c_str());
+		snprintf(chunk, sizeof(chunk),
+				 ",\"samples\":%lu,\"mean_us\":%.1f,\"min_us\":%lu,\"max_us\":%lu,"
+				 "\"mean_cycles\":%.0f,\"share\":%.3f}",
+				 (unsigned long) stats.samples, stats.mean_us, (unsigned long) stats.min_us,
+				 (unsigned long) stats.max_us, stats.mean_cycles, invoke_us > 0 ? stats.mean_us / invoke_us : 0.0f);
+		httpd_resp_sendstr_chunk(req, chunk);
+	}
+
+	httpd_resp_sendstr_chunk(req, "]}");
+	return httpd_resp_sendstr_chunk(req, NULL);
+}
+#endif
+
+void loop(tcp_server_t *server) {
+	static const tcp_server_handlers_t handlers = {
+		on_open,
+		on_readable,
+		wants_read,
+		wants_write,
+		on_writable,
+		on_close,
+	};
+
+	ESP_LOGI("tcp_server", "Waiting for client connections...");
+	track_allocations("tcp_server");
+	tcp_server_run(server, &handlers);
 }
@@ -4,6 +4,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "micro_ops.h"
+#include "esp_nn_guard.h"
 
 // Model: models/resnet8_frozen.tflite
 tflite::MicroMutableOpResolver<7>* get_micro_op_resolver(tflite::ErrorReporter* error_reporter) {
@@ -14,7 +15,7 @@ tflite::MicroMutableOpResolver<7>* get_micro_op_resolver(tflite::ErrorReporter*
         vTaskDelete(NULL);
     }
 
-    if (resolver->AddSoftmax() != kTfLiteOk) {
+    if (resolver->AddSoftmax(EspNnScratchGuard<tflite::BuiltinOperator_SOFTMAX>::Wrap(tflite::Register_SOFTMAX())) != kTfLiteOk) {
         error_reporter->Report("AddSoftmax failed");
         vTaskDelete(NULL);
     }
@@ -34,7 +35,7 @@ tflite::MicroMutableOpResolver<7>* get_micro_op_resolver(tflite::ErrorReporter*
         vTaskDelete(NULL);
     }
 
-    if (resolver->AddConv2D() != kTfLiteOk) {
+    if (resolver->AddConv2D(EspNnScratchGuard<tflite::BuiltinOperator_CONV_2D>::Wrap(tflite::Register_CONV_2D())) != kTfLiteOk) {
         error_reporter->Report("AddConv2D failed");
         vTaskDelete(NULL);
     }
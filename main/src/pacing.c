@@ -0,0 +1,213 @@
+#include "pacing.h"
+
+#include <math.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "soc/soc_caps.h"
+
+#if SOC_TEMP_SENSOR_SUPPORTED
+#include "driver/temperature_sensor.h"
+#endif
+
+static const char *TAG = "[pacing]";
+
+// The chip temperature is sampled at most once per second
+#define TEMPERATURE_SAMPLE_INTERVAL	1000000
+// The global compute budget can hold at most one second of Invoke() time
+#define COMPUTE_BURST			1000000.0f
+
+static portMUX_TYPE pacing_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static pacing_config_t pacing_config = {
+	.connection_rate = PACING_DEFAULT_CONNECTION_RATE,
+	.connection_burst = PACING_DEFAULT_CONNECTION_BURST,
+	.max_duty_cycle = PACING_DEFAULT_MAX_DUTY_CYCLE,
+	.min_duty_cycle = PACING_DEFAULT_MIN_DUTY_CYCLE,
+	.throttle_temp = PACING_DEFAULT_THROTTLE_TEMP,
+	.critical_temp = PACING_DEFAULT_CRITICAL_TEMP,
+	.yield_interval_ms = PACING_DEFAULT_YIELD_INTERVAL,
+};
+
+// Global bucket, measured in microseconds of Invoke() time
+static token_bucket_t compute_bucket;
+static float duty_cycle = PACING_DEFAULT_MAX_DUTY_CYCLE;
+static float temperature = NAN;
+static int64_t last_temperature_sample = 0;
+// Inference tasks sharing the global bucket, each one may spend the duty cycle of its core
+static int worker_count = 0;
+
+#if SOC_TEMP_SENSOR_SUPPORTED
+static temperature_sensor_handle_t temp_sensor = NULL;
+#endif
+
+static void token_bucket_refill(token_bucket_t *bucket, float rate, float burst, int64_t now) {
+	bucket->tokens += rate * (now - bucket->last_update) / 1000000.0f;
+	if (bucket->tokens > burst) {
+		bucket->tokens = burst;
+	}
+	bucket->last_update = now;
+}
+
+// Scales the global duty cycle down linearly between the throttle and the critical temperature
+static void update_duty_cycle(int64_t now) {
+	if (now - last_temperature_sample < TEMPERATURE_SAMPLE_INTERVAL) {
+		return;
+	}
+
+	float celsius = NAN;
+#if SOC_TEMP_SENSOR_SUPPORTED
+	if (temp_sensor && temperature_sensor_get_celsius(temp_sensor, &celsius) != ESP_OK) {
+		celsius = NAN;
+	}
+#endif
+
+	portENTER_CRITICAL(&pacing_lock);
+	last_temperature_sample = now;
+	temperature = celsius;
+
+	if (isnan(celsius) || celsius <= pacing_config.throttle_temp) {
+		duty_cycle = pacing_config.max_duty_cycle;
+	} else if (celsius >= pacing_config.critical_temp) {
+		duty_cycle = pacing_config.min_duty_cycle;
+	} else {
+		float ratio = (celsius - pacing_config.throttle_temp) /
+					  (pacing_config.critical_temp - pacing_config.throttle_temp);
+		duty_cycle = pacing_config.max_duty_cycle -
+					 ratio * (pacing_config.max_duty_cycle - pacing_config.min_duty_cycle);
+	}
+	portEXIT_CRITICAL(&pacing_lock);
+}
+
+void pacing_init(void) {
+#if SOC_TEMP_SENSOR_SUPPORTED
+	temperature_sensor_config_t temp_sensor_config = TEMPERATURE_SENSOR_CONFIG_DEFAULT(20, 100);
+	if (temperature_sensor_install(&temp_sensor_config, &temp_sensor) != ESP_OK ||
+		temperature_sensor_enable(temp_sensor) != ESP_OK) {
+		ESP_LOGW(TAG, "Temperature sensor unavailable, thermal throttling disabled");
+		temp_sensor = NULL;
+	}
+#else
+	ESP_LOGW(TAG, "No temperature sensor on this chip, thermal throttling disabled");
+#endif
+
+	compute_bucket.tokens = COMPUTE_BURST;
+	compute_bucket.last_update = esp_timer_get_time();
+	update_duty_cycle(compute_bucket.last_update);
+}
+
+void pacing_get_config(pacing_config_t *config) {
+	portENTER_CRITICAL(&pacing_lock);
+	*config = pacing_config;
+	portEXIT_CRITICAL(&pacing_lock);
+}
+
+int pacing_set_config(const pacing_config_t *config) {
+	if (config->connection_rate < 0 || config->connection_burst < 1 ||
+		config->min_duty_cycle <= 0 || config->min_duty_cycle > config->max_duty_cycle ||
+		config->max_duty_cycle > 1 || config->throttle_temp >= config->critical_temp ||
+		config->yield_interval_ms == 0) {
+		ESP_LOGE(TAG, "Invalid pacing configuration");
+		return -1;
+	}
+
+	portENTER_CRITICAL(&pacing_lock);
+	pacing_config = *config;
+	// Force the duty cycle to be recomputed with the new limits
+	last_temperature_sample = 0;
+	portEXIT_CRITICAL(&pacing_lock);
+
+	ESP_LOGI(TAG, "Pacing: %.2f req/s per connection (burst %.0f), duty cycle %.2f-%.2f",
+			 config->connection_rate, config->connection_burst,
+			 config->min_duty_cycle, config->max_duty_cycle);
+	return 0;
+}
+
+float pacing_get_temperature(void) {
+	return temperature;
+}
+
+float pacing_get_duty_cycle(void) {
+	return duty_cycle;
+}
+
+void pacing_connection_init(pacing_connection_t *conn) {
+	portENTER_CRITICAL(&pacing_lock);
+	conn->bucket.tokens = pacing_config.connection_burst;
+	portEXIT_CRITICAL(&pacing_lock);
+
+	conn->bucket.last_update = esp_timer_get_time();
+}
+
+int64_t pacing_connection_delay(pacing_connection_t *conn) {
+	int64_t wait_us = 0;
+
+	portENTER_CRITICAL(&pacing_lock);
+	// The bucket may be overdrawn by a single request, the debt is paid
+	// off by waiting before the next one
+	if (pacing_config.connection_rate > 0) {
+		token_bucket_refill(&conn->bucket, pacing_config.connection_rate,
+							pacing_config.connection_burst, esp_timer_get_time());
+		if (conn->bucket.tokens < 0) {
+			wait_us = -conn->bucket.tokens * 1000000.0f / pacing_config.connection_rate;
+		}
+	}
+	portEXIT_CRITICAL(&pacing_lock);
+
+	return wait_us;
+}
+
+void pacing_connection_charge(pacing_connection_t *conn, int samples) {
+	portENTER_CRITICAL(&pacing_lock);
+	if (pacing_config.connection_rate > 0) {
+		conn->bucket.tokens -= samples;
+	}
+	portEXIT_CRITICAL(&pacing_lock);
+}
+
+void pacing_worker_init(pacing_worker_t *worker) {
+	portENTER_CRITICAL(&pacing_lock);
+	worker_count++;
+	portEXIT_CRITICAL(&pacing_lock);
+
+	worker->last_yield = esp_timer_get_time();
+}
+
+void pacing_wait_compute(pacing_worker_t *worker) {
+	while (1) {
+		int64_t now = esp_timer_get_time();
+		int64_t wait_us = 0;
+
+		update_duty_cycle(now);
+
+		portENTER_CRITICAL(&pacing_lock);
+		float rate = duty_cycle * worker_count;
+		token_bucket_refill(&compute_bucket, rate * 1000000.0f, COMPUTE_BURST * worker_count, now);
+		if (compute_bucket.tokens < 0) {
+			wait_us = -compute_bucket.tokens / rate;
+		}
+		portEXIT_CRITICAL(&pacing_lock);
+
+		if (wait_us > 0) {
+			TickType_t ticks = pdMS_TO_TICKS((wait_us + 999) / 1000);
+			vTaskDelay(ticks > 0 ? ticks : 1);
+			worker->last_yield = esp_timer_get_time();
+			continue;
+		}
+
+		// A busy inference task still gives the idle task (and its watchdog) a tick
+		if (now - worker->last_yield >= (int64_t) pacing_config.yield_interval_ms * 1000) {
+			vTaskDelay(1);
+			worker->last_yield = esp_timer_get_time();
+		}
+		return;
+	}
+}
+
+void pacing_account(int64_t invoke_time_us) {
+	portENTER_CRITICAL(&pacing_lock);
+	compute_bucket.tokens -= invoke_time_us;
+	portEXIT_CRITICAL(&pacing_lock);
+}
@@ -0,0 +1,35 @@
+#include "quantization.h"
+
+#include "tensorflow/lite/c/common.h"
+
+DequantizeKernel GetDequantizeKernel(const TfLiteTensor* tensor) {
+	bool quantized = tensor->quantization.type != kTfLiteNoQuantization;
+
+	switch (tensor->type) {
+		case kTfLiteFloat32:
+			return DequantizeValues<float, false>;
+		case kTfLiteUInt8:
+			return quantized ? DequantizeValues<uint8_t, true> : DequantizeValues<uint8_t, false>;
+		case kTfLiteInt8:
+			return quantized ? DequantizeValues<int8_t, true> : DequantizeValues<int8_t, false>;
+		case kTfLiteInt16:
+			return quantized ? DequantizeValues<int16_t, true> : DequantizeValues<int16_t, false>;
+		case kTfLiteInt32:
+			return DequantizeValues<int32_t, false>;
+		case kTfLiteBool:
+			return DequantizeValues<bool, false>;
+		default:
+			return nullptr;
+	}
+}
+
+QuantizeKernel GetQuantizeKernel(const TfLiteTensor* tensor) {
+	switch (tensor->type) {
+		case kTfLiteUInt8:
+			return QuantizeValues<uint8_t>;
+		case kTfLiteInt8:
+			return QuantizeValues<int8_t>;
+		default:
+			return nullptr;
+	}
+}
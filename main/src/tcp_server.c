@@ -4,14 +4,39 @@
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_netif.h"
+#include "esp_vfs_eventfd.h"
+
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
 
 static const char *TAG = "[tcp_server]";
 
+static int set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		ESP_LOGE(TAG, "fcntl failed: errno %d", errno);
+		return -1;
+	}
+	return 0;
+}
+
 int tcp_server_init(tcp_server_t *server) {
 	int opt = 1;
 
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		server->connections[i] = -1;
+	}
+
+	// Lets the other tasks end the wait for events of tcp_server_run()
+	esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+	if (esp_vfs_eventfd_register(&eventfd_config) != ESP_OK || (server->wake_fd = eventfd(0, 0)) < 0) {
+		ESP_LOGE(TAG, "eventfd failed: errno %d", errno);
+		return -1;
+	}
+
 	// Create socket
-	if ((server->server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+	if ((server->server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
 		ESP_LOGE(TAG, "socket failed: errno %d", errno);
 		return -1;
 	}
@@ -35,48 +60,179 @@ int tcp_server_init(tcp_server_t *server) {
 		return -1;
 	}
 
+	// Accepting never blocks, every pending connection is accepted when the socket is readable
+	if (set_nonblocking(server->server_fd)) {
+		close(server->server_fd);
+		return -1;
+	}
+
 	// Listen for connections
-	if (listen(server->server_fd, 3) < 0) {
+	if (listen(server->server_fd, MAX_CONNECTIONS) < 0) {
 		ESP_LOGE(TAG, "listen failed: errno %d", errno);
 		close(server->server_fd);
 		return -1;
 	}
 
-	ESP_LOGI(TAG, "Server is listening on port %d", PORT);
+	ESP_LOGI(TAG, "Server is listening on port %d (max %d connections)", PORT, MAX_CONNECTIONS);
 	return 0;
 }
 
-int tcp_server_accept(tcp_server_t *server) {
-	int new_socket;
-	if ((new_socket = accept(server->server_fd, (struct sockaddr *)&server->address, (socklen_t *)&server->addrlen)) < 0) {
-		ESP_LOGE(TAG, "accept failed: errno %d", errno);
-		return -1;
+static int find_free_slot(tcp_server_t *server) {
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		if (server->connections[i] < 0) {
+			return i;
+		}
 	}
-	return new_socket;
+	return -1;
 }
 
-ssize_t tcp_server_receive(int client_socket, void *buffer, size_t buffer_size) {
-	ssize_t total_size = 0, size = 0;
-	while (total_size < buffer_size) {
-		size = recv(client_socket, buffer + total_size, buffer_size - total_size, 0);
-		if (size < 0) {
-			ESP_LOGE(TAG, "recv failed: errno %d", errno);
-			return -1;
+// Accepts every pending connection while there are free slots
+static void accept_pending(tcp_server_t *server, const tcp_server_handlers_t *handlers) {
+	int slot;
+	while ((slot = find_free_slot(server)) >= 0) {
+		int new_socket = accept(server->server_fd, (struct sockaddr *)&server->address, (socklen_t *)&server->addrlen);
+		if (new_socket < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				ESP_LOGE(TAG, "accept failed: errno %d", errno);
+			}
+			return;
+		}
+
+		// Replies are queued in one piece, there is nothing for Nagle's algorithm to coalesce
+		int nodelay = 1;
+		if (setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay))) {
+			ESP_LOGW(TAG, "setsockopt TCP_NODELAY failed: errno %d", errno);
 		}
-		total_size += size;
+
+		if (set_nonblocking(new_socket) || handlers->on_open(slot, new_socket)) {
+			close(new_socket);
+			continue;
+		}
+
+		server->connections[slot] = new_socket;
+		ESP_LOGI(TAG, "New client connected (slot %d)", slot);
 	}
-	return total_size;
 }
 
-ssize_t tcp_server_send(int client_socket, const void *buffer, size_t buffer_size) {
-	ssize_t total_size = 0, size = 0;
-	while (total_size < buffer_size) {
-		size = send(client_socket, buffer + total_size, buffer_size - total_size, 0);
-		if (size < 0) {
-			ESP_LOGE(TAG, "send failed: errno %d", errno);
-			return -1;
+static void close_connection(tcp_server_t *server, const tcp_server_handlers_t *handlers, int slot) {
+	int client_socket = server->connections[slot];
+
+	handlers->on_close(slot, client_socket);
+	close(client_socket);
+	server->connections[slot] = -1;
+	ESP_LOGI(TAG, "Client disconnected (slot %d)", slot);
+}
+
+void tcp_server_run(tcp_server_t *server, const tcp_server_handlers_t *handlers) {
+	while (1) {
+		fd_set read_fds, write_fds;
+		FD_ZERO(&read_fds);
+		FD_ZERO(&write_fds);
+
+		// Wakes are read once they have ended the wait, before the handlers look for work again
+		FD_SET(server->wake_fd, &read_fds);
+		int max_fd = server->wake_fd;
+		int throttled = 0;
+		int connected = 0;
+		for (int i = 0; i < MAX_CONNECTIONS; i++) {
+			int fd = server->connections[i];
+			if (fd < 0) {
+				continue;
+			}
+			int wants_read = handlers->wants_read(i);
+			if (wants_read < 0) {
+				close_connection(server, handlers, i);
+				continue;
+			}
+			connected = 1;
+			if (handlers->wants_write(i)) {
+				FD_SET(fd, &write_fds);
+				max_fd = fd > max_fd ? fd : max_fd;
+			}
+			if (!wants_read) {
+				throttled = 1;
+				continue;
+			}
+			FD_SET(fd, &read_fds);
+			max_fd = fd > max_fd ? fd : max_fd;
+		}
+
+		// While every slot is taken, new clients wait in the listen backlog
+		int accepting = find_free_slot(server) >= 0;
+		if (accepting) {
+			FD_SET(server->server_fd, &read_fds);
+			max_fd = server->server_fd > max_fd ? server->server_fd : max_fd;
+		}
+
+		// Throttled connections are polled, open ones checked for stalled requests now and then,
+		// otherwise wait for the next event
+		struct timeval poll_interval = {
+			.tv_sec = 0,
+			.tv_usec = TCP_SERVER_POLL_INTERVAL_MS * 1000,
+		};
+		struct timeval io_timeout = {
+			.tv_sec = TCP_IO_TIMEOUT_MS / 1000,
+			.tv_usec = (TCP_IO_TIMEOUT_MS % 1000) * 1000,
+		};
+		struct timeval *timeout = throttled ? &poll_interval : connected ? &io_timeout : NULL;
+		int ready = select(max_fd + 1, &read_fds, &write_fds, NULL, timeout);
+		if (ready < 0) {
+			ESP_LOGE(TAG, "select failed: errno %d", errno);
+			vTaskDelay(pdMS_TO_TICKS(TCP_SERVER_POLL_INTERVAL_MS));
+			continue;
+		}
+
+		if (FD_ISSET(server->wake_fd, &read_fds)) {
+			uint64_t wakes;
+			read(server->wake_fd, &wakes, sizeof(wakes));
+		}
+
+		for (int i = 0; i < MAX_CONNECTIONS; i++) {
+			int fd = server->connections[i];
+			if (fd >= 0 && FD_ISSET(fd, &write_fds) && handlers->on_writable(i, fd)) {
+				close_connection(server, handlers, i);
+				continue;
+			}
+			if (fd >= 0 && FD_ISSET(fd, &read_fds) && handlers->on_readable(i, fd)) {
+				close_connection(server, handlers, i);
+			}
 		}
-		total_size += size;
+
+		if (accepting && FD_ISSET(server->server_fd, &read_fds)) {
+			accept_pending(server, handlers);
+		}
+	}
+}
+
+ssize_t tcp_server_read(int client_socket, void *buffer, size_t buffer_size) {
+	ssize_t size = recv(client_socket, buffer, buffer_size, 0);
+	if (size > 0) {
+		return size;
+	}
+	if (size == 0) {
+		// Connection closed by the client
+		return -1;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		return 0;
+	}
+	ESP_LOGE(TAG, "recv failed: errno %d", errno);
+	return -1;
+}
+
+ssize_t tcp_server_write(int client_socket, const void *buffer, size_t buffer_size) {
+	ssize_t size = send(client_socket, buffer, buffer_size, 0);
+	if (size >= 0) {
+		return size;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		return 0;
 	}
-	return total_size;
-}
\ No newline at end of file
+	ESP_LOGE(TAG, "send failed: errno %d", errno);
+	return -1;
+}
+
+void tcp_server_wake(tcp_server_t *server) {
+	uint64_t wake = 1;
+	write(server->wake_fd, &wake, sizeof(wake));
+}
@@ -0,0 +1,45 @@
+#include "udp_server.h"
+#include "esp_log.h"
+
+#include <errno.h>
+
+static const char *TAG = "[udp_server]";
+
+int udp_server_init(udp_server_t *server, uint16_t port) {
+	// Create socket
+	if ((server->server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		ESP_LOGE(TAG, "socket failed: errno %d", errno);
+		return -1;
+	}
+
+	// Bind socket to port
+	server->address.sin_family = AF_INET;
+	server->address.sin_addr.s_addr = INADDR_ANY;
+	server->address.sin_port = htons(port);
+
+	if (bind(server->server_fd, (struct sockaddr *)&server->address, sizeof(server->address)) < 0) {
+		ESP_LOGE(TAG, "bind failed: errno %d", errno);
+		close(server->server_fd);
+		return -1;
+	}
+
+	ESP_LOGI(TAG, "Server is listening on UDP port %d", port);
+	return 0;
+}
+
+ssize_t udp_server_receive(udp_server_t *server, void *buffer, size_t buffer_size, struct sockaddr_in *from) {
+	socklen_t from_len = sizeof(*from);
+	ssize_t size = recvfrom(server->server_fd, buffer, buffer_size, 0, (struct sockaddr *)from, &from_len);
+	if (size < 0) {
+		ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
+	}
+	return size;
+}
+
+ssize_t udp_server_send(udp_server_t *server, const void *buffer, size_t buffer_size, const struct sockaddr_in *to) {
+	ssize_t size = sendto(server->server_fd, buffer, buffer_size, 0, (const struct sockaddr *)to, sizeof(*to));
+	if (size < 0) {
+		ESP_LOGE(TAG, "sendto failed: errno %d", errno);
+	}
+	return size;
+}
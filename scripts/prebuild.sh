@@ -17,6 +17,9 @@ CONFIG_ESP_IMAGE_BOOTLOADER_SEL_OTA=y
 CONFIG_ESP_WIFI_GMAC_SUPPORT=n
 CONFIG_PARTITION_TABLE_MD5=y
 CONFIG_MBEDTLS_HKDF_C=y
+
+# Counts every heap allocation, so that the request path can report the ones it makes
+CONFIG_HEAP_USE_HOOKS=y
 EOF
 echo "Created new sdkconfig.defaults"
 
@@ -70,7 +73,7 @@ VENV_DIR=".venv"
 python3 -m venv $VENV_DIR
 echo "Virtual environment created at $VENV_DIR"
 . ./$VENV_DIR/bin/activate
-pip install requests ai-edge-litert
+pip install requests ai-edge-litert flatbuffers
 
 echo "Running tflite_micro_helper.py with model: $model..."
 python3 scripts/tflite_micro_helper.py "$model"
@@ -84,6 +87,15 @@ else
 	echo "Python script executed successfully."
 fi
 
+# Step 6: Build with the model carrying the offline memory plan, when one was generated
+planned="${model%.*}_planned.${model##*.}"
+if [ -f "$planned" ]; then
+	export model="$planned"
+fi
+len=$(ls -l "$model" | awk '{ print $5 }')
+export tflite_model_size=$len
+echo "model is set to $model, tflite_model_size is set to $tflite_model_size."
+
 deactivate
 rm -rf $VENV_DIR
 echo "Virtual environment deleted."
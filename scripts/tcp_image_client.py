@@ -7,6 +7,16 @@ import argparse
 labels = ["T_shirt_top", "Trouser", "Pullover", "Dress", "Coat",
 		"Sandal", "Shirt", "Sneaker", "Bag", "Ankle_boot"]
 
+encodings = {"float32": 0, "int8": 1, "uint8": 2, "pixel": 3, "frame": 4}
+
+# Oldest and newest handshake layouts the client can read
+MIN_PROTOCOL_VERSION = 2
+PROTOCOL_VERSION = 4
+
+# Startup phases of the boot timeline, in the order of the handshake
+boot_phases = ["nvs_flash_init", "connect_wifi", "akri_server_start", "get_model",
+		"arena_allocation", "allocate_tensors", "warmup"]
+
 def load_images(image_dir):
 	images = []
 	for filename in sorted(os.listdir(image_dir)):
@@ -27,6 +37,162 @@ def recv_all(sock, length):
 		data += more
 	return data
 
+# TfLiteType of int8 tensors
+TFLITE_INT8 = 9
+
+# Quantizes a float32 image with the input tensor's scale and zero point
+def quantize_image(image_data, encoding, tensor):
+	pixels = struct.unpack(f'<{len(image_data) // 4}f', image_data)
+	if encoding == "pixel":
+		# Raw 8-bit pixels, the device normalizes and quantizes them itself
+		return struct.pack(f'{len(pixels)}B', *[max(0, min(255, round(p * 255))) for p in pixels])
+	values = [round(p / tensor["scale"]) + tensor["zero_point"] for p in pixels]
+	if encoding == "int8":
+		return struct.pack(f'{len(pixels)}b', *[max(-128, min(127, v)) for v in values])
+	if tensor["type"] == TFLITE_INT8:
+		# The device flips the sign bit of uint8 values sent to an int8 tensor, so they are shifted by 128
+		values = [max(-128, min(127, v)) + 128 for v in values]
+	return struct.pack(f'{len(pixels)}B', *[max(0, min(255, v)) for v in values])
+
+# Turns a float32 image into a raw uint8 frame, scaled up `frame_scale` times with
+# nearest neighbour, which the device resizes back to the input tensor
+def frame_image(image_data, width, channels, frame_scale):
+	pixels = struct.unpack(f'<{len(image_data) // 4}f', image_data)
+	pixels = [max(0, min(255, round(p * 255))) for p in pixels]
+	row_size = width * channels
+	frame = bytearray()
+	for row in range(len(pixels) // row_size):
+		line = bytearray()
+		for x in range(width):
+			line += bytes(pixels[row * row_size + x * channels:row * row_size + (x + 1) * channels]) * frame_scale
+		frame += line * frame_scale
+	return bytes(frame)
+
+# Reads a tensor descriptor of the handshake reply
+def recv_tensor_info(sock):
+	tensor_type, dims_count = struct.unpack('<BB', recv_all(sock, 2))
+	dims = struct.unpack(f'<{dims_count}i', recv_all(sock, 4 * dims_count))
+	scale, zero_point = struct.unpack('<fi', recv_all(sock, 8))
+	return {"type": tensor_type, "dims": dims, "scale": scale, "zero_point": zero_point}
+
+# Reads a length-prefixed string of the handshake reply
+def recv_string(sock):
+	length = recv_all(sock, 1)[0]
+	return recv_all(sock, length).decode()
+
+# Asks the server for the model's identity, tensor shapes and supported input encodings
+def get_info(sock):
+	sock.sendall(b'\x04')
+	version, encoding_mask, model_hash, model_size = struct.unpack('<BBII', recv_all(sock, 10))
+	if not MIN_PROTOCOL_VERSION <= version <= PROTOCOL_VERSION:
+		raise ValueError(f"Unsupported protocol version {version} (supported {MIN_PROTOCOL_VERSION} to {PROTOCOL_VERSION})")
+	info = {
+		"version": version,
+		"encodings": [name for name, value in encodings.items() if encoding_mask & (1 << value)],
+		"hash": model_hash,
+		"size": model_size,
+		"name": recv_string(sock),
+		"firmware": recv_string(sock),
+		"input": recv_tensor_info(sock),
+		"output": recv_tensor_info(sock),
+		"boot": {},
+	}
+	if version >= 4:
+		# Start and duration (us) of every startup phase of the current boot
+		count = recv_all(sock, 1)[0]
+		for i in range(count):
+			start, duration = struct.unpack('<II', recv_all(sock, 8))
+			name = boot_phases[i] if i < len(boot_phases) else f"phase_{i}"
+			info["boot"][name] = (start, duration)
+	info["num_scores"] = 1
+	for dim in info["output"]["dims"]:
+		info["num_scores"] *= dim
+	return info
+
+# Picks the supported encoding with the fewest bytes on the wire
+def pick_encoding(info):
+	for encoding in ("pixel", "int8", "uint8", "float32"):
+		if encoding in info["encodings"]:
+			return encoding
+	raise ValueError("The server does not support any known input encoding")
+
+# Selects the encoding of the images sent on this connection
+def set_encoding(sock, encoding):
+	sock.sendall(b'\x03' + struct.pack('B', encodings[encoding]))
+	status = recv_all(sock, 1)[0]
+	if status != 0:
+		raise ValueError(f"Input encoding {encoding} is not supported by the model")
+
+# Switches the connection to raw frames of the given size, which the device resizes to
+# the input tensor and normalizes as (pixel / 255 - mean) / std
+def set_preprocess(sock, width, height, channels, mean, std, resize_mode=0):
+	sock.sendall(struct.pack('<BHHBHHHHB', 0x07, width, height, channels, 0, 0, 0, 0, resize_mode) +
+				 struct.pack(f'<{channels}f', *[mean] * channels) + struct.pack(f'<{channels}f', *[std] * channels))
+	status = recv_all(sock, 1)[0]
+	if status != 0:
+		raise ValueError(f"Frames of {width}x{height}x{channels} are not supported by the model")
+
+# Sends a single image and receives its scores and inference time (in ms)
+def request_single(sock, image_data, num_scores):
+	sock.sendall(b'\x01' + image_data)
+
+	scores_data = recv_all(sock, 4 * num_scores)  # num_scores floats, 4 bytes each
+	scores = struct.unpack(f'{num_scores}f', scores_data)
+	inference_time_data = recv_all(sock, 8)  # int64_t, 8 bytes
+	inference_time = (struct.unpack('q', inference_time_data)[0]) / 1000
+	return scores, inference_time
+
+# Sends a batch of images in one request and receives all the scores and inference times
+def request_batch(sock, batch_images):
+	sock.sendall(b'\x02' + struct.pack('B', len(batch_images)) + b''.join(batch_images))
+
+	count, num_scores = struct.unpack('<BH', recv_all(sock, 3))
+	results = []
+	for _ in range(count):
+		scores = struct.unpack(f'<{num_scores}f', recv_all(sock, 4 * num_scores))
+		inference_time = (struct.unpack('<q', recv_all(sock, 8))[0]) / 1000
+		results.append((scores, inference_time))
+	return results
+
+# Sends lockstep requests of batch_size images and yields the results in order
+def run_lockstep(sock, images, batch_size, num_scores):
+	image_index = 0
+	while True:
+		# Collect the images of the next request
+		batch = [images[(image_index + i) % len(images)] for i in range(batch_size)]
+		image_index = (image_index + batch_size) % len(images)
+
+		# Send the images to the server and receive scores and inference times
+		if batch_size > 1:
+			results = request_batch(sock, [image_data for _, image_data in batch])
+		else:
+			results = [request_single(sock, batch[0][1], num_scores)]
+
+		for (label_index, _), (scores, inference_time) in zip(batch, results):
+			yield label_index, scores, inference_time
+
+# Keeps `depth` tagged requests in flight and yields the results as they arrive
+def run_pipelined(sock, images, depth, num_scores):
+	in_flight = {}
+	request_id = 0
+	while True:
+		while len(in_flight) < depth:
+			label_index, image_data = images[request_id % len(images)]
+			sock.sendall(struct.pack('<BI', 0x05, request_id) + image_data)
+			in_flight[request_id] = label_index
+			request_id = (request_id + 1) & 0xFFFFFFFF
+
+		reply_id, status, length = struct.unpack('<IBH', recv_all(sock, 7))
+		payload = recv_all(sock, length)
+		label_index = in_flight.pop(reply_id)
+		if status != 0:
+			print(f"Request {reply_id} failed with status {status}")
+			continue
+
+		scores = struct.unpack(f'<{num_scores}f', payload[:4 * num_scores])
+		inference_time = (struct.unpack('<q', payload[4 * num_scores:])[0]) / 1000
+		yield label_index, scores, inference_time
+
 def main():
 	# Parse command line arguments
 	parser = argparse.ArgumentParser()
@@ -34,6 +200,15 @@ def main():
 	parser.add_argument("--top_k", type=int, default=10, help="Number of top predictions to keep")
 	parser.add_argument("--server_ip", type=str, default='192.168.11.57', help="IP address of the ESP32 server")
 	parser.add_argument("--server_port", type=int, default=1234, help="Port number of the ESP32 server")
+	parser.add_argument("--batch_size", type=int, default=1, help="Number of images sent per request (max 32)")
+	parser.add_argument("--pipeline", type=int, default=0,
+						help="Number of tagged requests kept in flight (0 sends lockstep requests)")
+	parser.add_argument("--encoding", type=str, default="auto", choices=["auto", *encodings.keys()],
+						help="Encoding of the images sent, auto picks the cheapest one supported by the model")
+	parser.add_argument("--frame_scale", type=int, default=2,
+						help="Upscaling of the frames sent with the frame encoding, the device resizes them back")
+	parser.add_argument("--pixel_mean", type=float, default=0.0, help="Normalization mean of the frame encoding")
+	parser.add_argument("--pixel_std", type=float, default=1.0, help="Normalization std of the frame encoding")
 	parser.add_argument("--image_dir", type=str,
 						default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "../test_data"),
 						help="Directory containing test images")
@@ -45,6 +220,9 @@ def main():
 	server_ip = args.server_ip
 	server_port = args.server_port
 	image_dir = args.image_dir
+	batch_size = args.batch_size
+	encoding = args.encoding
+	pipeline = args.pipeline
 
 	images = load_images(image_dir)
 	image_count = len(images)
@@ -59,6 +237,31 @@ def main():
 	client_socket.connect((server_ip, server_port))
 	print(f"Connected to server at {server_ip} : {server_port}")
 
+	info = get_info(client_socket)
+	print(f"Model {info['name']} (firmware {info['firmware']}, hash {info['hash']:08x}): "
+		  f"input {info['input']['dims']}, output {info['output']['dims']}, encodings {info['encodings']}")
+	if info["boot"]:
+		print("Boot timeline: " + ", ".join(f"{name} {duration / 1000:.1f} ms"
+											for name, (start, duration) in info["boot"].items() if start))
+
+	if encoding == "auto":
+		encoding = pick_encoding(info)
+	print(f"Using {encoding} input encoding")
+
+	if encoding == "frame":
+		# The input tensor is [1, height, width(, channels)]
+		dims = info["input"]["dims"]
+		height, width = dims[1], dims[2]
+		channels = dims[3] if len(dims) > 3 else 1
+		images = [(label_index, frame_image(image_data, width, channels, args.frame_scale))
+				  for label_index, image_data in images]
+		set_preprocess(client_socket, width * args.frame_scale, height * args.frame_scale, channels,
+					   args.pixel_mean, args.pixel_std)
+	elif encoding != "float32":
+		images = [(label_index, quantize_image(image_data, encoding, info["input"]))
+				  for label_index, image_data in images]
+		set_encoding(client_socket, encoding)
+
 	image_index = 0
 	log_file = open("results.txt", "w")
 	original_stdout = sys.stdout
@@ -69,23 +272,14 @@ def main():
 	inference_times = []
 
 	try:
-		while True:
-			# Send request byte to the server
-			client_socket.sendall(b'\x01')
+		if pipeline > 0:
+			results = run_pipelined(client_socket, images, pipeline, info["num_scores"])
+		else:
+			results = run_lockstep(client_socket, images, batch_size, info["num_scores"])
 
-			# Send image data to the server
-			label_index, image_data = images[image_index]
+		for label_index, scores, inference_time in results:
 			print(f"File: {labels[label_index]}")
-			client_socket.sendall(image_data)
-
-			# Receive scores and inference time from the server
-			num_labels = len(labels)
-			scores_data = recv_all(client_socket, 4 * num_labels)  # num_labels floats, 4 bytes each
-			scores = struct.unpack(f'{num_labels}f', scores_data)
-			inference_time_data = recv_all(client_socket, 8)  # int64_t, 8 bytes
-			inference_time = (struct.unpack('q', inference_time_data)[0]) / 1000
-			
-			
+
 			# Keep track of correct predictions and inference times
 			if not log_file.closed:
 				predicted_label = labels[scores.index(max(scores))]
@@ -124,7 +318,7 @@ def main():
 				print(f"Accuracy: {accuracy}%")
 				print(f"Average Inference Time: {mean_latency} ms")
 				print(f"Standard Deviation of Inference Time: {std_dev_latency} ms")
-				
+			
 				# Switch back to stdout
 				sys.stdout = original_stdout
 				log_file.close()
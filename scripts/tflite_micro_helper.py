@@ -6,7 +6,10 @@ import re
 import subprocess
 import json
 import shutil
+import struct
+import flatbuffers
 from ai_edge_litert.interpreter import Interpreter
+from ai_edge_litert import schema_py_generated as schema_fb
 import requests
 
 SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
@@ -18,6 +21,26 @@ MICRO_OPS_HEADER_URL = "https://raw.githubusercontent.com/tensorflow/tflite-micr
 MICRO_OPS_JSON_PATH = os.path.join(SCRIPT_DIR, "micro_ops.json")
 MICRO_OPS_CPP_PATH = os.path.join(SCRIPT_DIR, "../main/src/micro_ops.cpp")
 MICRO_OPS_HEADER_PATH = os.path.join(SCRIPT_DIR, "../main/inc/micro_ops.h")
+MEMORY_PLAN_HEADER_PATH = os.path.join(SCRIPT_DIR, "../main/inc/micro_memory_plan.h")
+
+# Metadata read by the TFLite Micro allocator: [version, subgraph, tensor count, offset of every tensor or -1]
+OFFLINE_PLAN_METADATA = "OfflineMemoryAllocation"
+# Alignment of the buffers in the arena and of the constant data in the flatbuffer, as in TFLite Micro
+BUFFER_ALIGNMENT = 16
+
+TENSOR_TYPE_SIZES = {
+	schema_fb.TensorType.FLOAT32: 4,
+	schema_fb.TensorType.FLOAT16: 2,
+	schema_fb.TensorType.FLOAT64: 8,
+	schema_fb.TensorType.INT64: 8,
+	schema_fb.TensorType.INT32: 4,
+	schema_fb.TensorType.UINT32: 4,
+	schema_fb.TensorType.INT16: 2,
+	schema_fb.TensorType.UINT16: 2,
+	schema_fb.TensorType.INT8: 1,
+	schema_fb.TensorType.UINT8: 1,
+	schema_fb.TensorType.BOOL: 1,
+}
 
 # Generates a C array from the model file using xxd
 def generate_cpp_array(model_path):
@@ -73,6 +96,14 @@ def get_model_operations(model_path):
 	ops_details = interpreter._get_ops_details()
 	return {op['op_name'] for op in ops_details}
 
+# Operators whose esp-nn kernels share a file-static scratch buffer, registered behind EspNnScratchGuard
+# (esp_nn_guard.h) so that interpreters on different cores do not run them at the same time
+ESP_NN_SCRATCH_OPS = {
+	"AddConv2D": ("CONV_2D", "Register_CONV_2D"),
+	"AddDepthwiseConv2D": ("DEPTHWISE_CONV_2D", "Register_DEPTHWISE_CONV_2D"),
+	"AddSoftmax": ("SOFTMAX", "Register_SOFTMAX"),
+}
+
 # Generate the micro_ops.cpp file, which will contain the get_micro_op_resolver function
 def generate_micro_ops_cpp(ops, model_path):
 	if os.path.exists(MICRO_OPS_CPP_PATH):
@@ -85,6 +116,7 @@ def generate_micro_ops_cpp(ops, model_path):
 		'#include "freertos/FreeRTOS.h"',
 		'#include "freertos/task.h"',
 		'#include "micro_ops.h"',
+		'#include "esp_nn_guard.h"',
 		'',
 		'// Model: {}'.format(model_path),
 		'tflite::MicroMutableOpResolver<{}>* get_micro_op_resolver(tflite::ErrorReporter* error_reporter) {{'.format(len(ops)),
@@ -93,7 +125,11 @@ def generate_micro_ops_cpp(ops, model_path):
 	]
 
 	for op in ops:
-		lines.append('    if (resolver->{}() != kTfLiteOk) {{'.format(op))
+		registration = ''
+		if op in ESP_NN_SCRATCH_OPS:
+			builtin, register = ESP_NN_SCRATCH_OPS[op]
+			registration = 'EspNnScratchGuard<tflite::BuiltinOperator_{}>::Wrap(tflite::{}())'.format(builtin, register)
+		lines.append('    if (resolver->{}({}) != kTfLiteOk) {{'.format(op, registration))
 		lines.append('        error_reporter->Report("{} failed");'.format(op))
 		lines.append('        vTaskDelete(NULL);')
 		lines.append('    }')
@@ -122,6 +158,167 @@ def generate_micro_ops_header(op_count):
 	with open(MICRO_OPS_HEADER_PATH, 'w') as f:
 		f.write('\n'.join(lines))
 
+def align(size):
+	return (size + BUFFER_ALIGNMENT - 1) // BUFFER_ALIGNMENT * BUFFER_ALIGNMENT
+
+def read_model(model_path):
+	with open(model_path, "rb") as f:
+		data = f.read()
+	return schema_fb.ModelT.InitFromObj(schema_fb.Model.GetRootAs(data, 0))
+
+# Packs the constant data of a buffer aligned, as the converter does, so that kernels can read it in place
+def pack_aligned_buffer(self, builder):
+	data = None
+	if self.data is not None and len(self.data) > 0:
+		raw = self.data.tobytes() if hasattr(self.data, "tobytes") else bytes(self.data)
+		builder.StartVector(1, len(raw), BUFFER_ALIGNMENT)
+		builder.head = builder.head - len(raw)
+		builder.Bytes[builder.head:builder.head + len(raw)] = raw
+		data = builder.EndVector()
+
+	schema_fb.BufferStart(builder)
+	if data is not None:
+		schema_fb.BufferAddData(builder, data)
+	if getattr(self, "offset", 0):
+		schema_fb.BufferAddOffset(builder, self.offset)
+		schema_fb.BufferAddSize(builder, self.size)
+	return schema_fb.BufferEnd(builder)
+
+def write_model(model, model_path):
+	schema_fb.BufferT.Pack = pack_aligned_buffer
+	builder = flatbuffers.Builder(1024)
+	builder.Finish(model.Pack(builder), file_identifier=b"TFL3")
+	with open(model_path, "wb") as f:
+		f.write(builder.Output())
+
+# Size in the arena of a tensor, None when it is not known offline
+def tensor_size(tensor):
+	if tensor.type not in TENSOR_TYPE_SIZES or tensor.shape is None or any(dim < 0 for dim in tensor.shape):
+		return None
+
+	count = 1
+	for dim in tensor.shape:
+		count *= dim
+	return align(count * TENSOR_TYPE_SIZES[tensor.type])
+
+# First and last operator of every tensor that lives in the arena, computed as by the TFLite Micro allocator.
+# Constant and variable tensors are persistent, they are not part of the plan.
+def tensor_lifetimes(model, subgraph):
+	def in_arena(index):
+		tensor = subgraph.tensors[index]
+		data = model.buffers[tensor.buffer].data if tensor.buffer < len(model.buffers) else None
+		return not tensor.isVariable and (data is None or len(data) == 0)
+
+	last_op = len(subgraph.operators) - 1
+	lifetimes = {}
+	for index in subgraph.inputs:
+		if in_arena(index):
+			lifetimes[index] = [0, 0]
+
+	for op_index, op in enumerate(subgraph.operators):
+		for index in list(op.inputs) + list(op.outputs):
+			if index >= 0 and in_arena(index):
+				lifetime = lifetimes.setdefault(index, [op_index, op_index])
+				lifetime[1] = max(lifetime[1], op_index)
+
+	for index in subgraph.outputs:
+		if index in lifetimes:
+			lifetimes[index][1] = last_op
+
+	return lifetimes
+
+# Places every buffer at the lowest offset that is free during its lifetime, in the given order
+def place_buffers(buffers, order):
+	placed = []
+	offsets = {}
+	for index in order:
+		size, first, last = buffers[index]
+		offset = 0
+		for other_offset, other_size in sorted((o, s) for o, s, f, l in placed if f <= last and first <= l):
+			if offset + size <= other_offset:
+				break
+			offset = max(offset, other_offset + other_size)
+		offsets[index] = offset
+		placed.append((offset, size, first, last))
+
+	peak = max((offsets[index] + buffers[index][0] for index in offsets), default=0)
+	return offsets, peak
+
+# Computes the offline memory plan of the main subgraph, keeping the smallest of a few greedy placements.
+# Returns the offset of every planned tensor and the size of the plan, None when the model cannot be planned.
+def plan_memory(model):
+	if len(model.subgraphs) != 1:
+		print("Offline memory planning skipped: the model has {} subgraphs".format(len(model.subgraphs)))
+		return None
+
+	subgraph = model.subgraphs[0]
+	buffers = {}
+	for index, (first, last) in tensor_lifetimes(model, subgraph).items():
+		size = tensor_size(subgraph.tensors[index])
+		if size is None:
+			print("Offline memory planning skipped: tensor {} has no static size".format(index))
+			return None
+		buffers[index] = (size, first, last)
+
+	orders = {
+		# The order of the TFLite Micro greedy planner
+		"size": sorted(buffers, key=lambda i: (-buffers[i][0], buffers[i][1])),
+		"lifetime": sorted(buffers, key=lambda i: (buffers[i][1] - buffers[i][2], -buffers[i][0])),
+		"first use": sorted(buffers, key=lambda i: (buffers[i][1], -buffers[i][0])),
+		"area": sorted(buffers, key=lambda i: -buffers[i][0] * (buffers[i][2] - buffers[i][1] + 1)),
+	}
+	plans = {name: place_buffers(buffers, order) for name, order in orders.items()}
+	best = min(plans, key=lambda name: plans[name][1])
+
+	# No plan can be smaller than the largest set of buffers live at once
+	lower_bound = max((sum(size for size, first, last in buffers.values() if first <= op <= last)
+					   for op in range(len(subgraph.operators))), default=0)
+	print("Offline memory plan: {} bytes with the {} order (greedy by size: {}, lower bound: {})".format(
+		plans[best][1], best, plans["size"][1], lower_bound))
+
+	return plans[best]
+
+# Stores the plan in the model metadata, replacing a previous one
+def embed_memory_plan(model, offsets):
+	tensor_count = len(model.subgraphs[0].tensors)
+	values = [0, 0, tensor_count] + [offsets.get(index, -1) for index in range(tensor_count)]
+	data = list(struct.pack("<{}i".format(len(values)), *values))
+
+	model.metadata = model.metadata or []
+	for metadata in model.metadata:
+		name = metadata.name.decode() if isinstance(metadata.name, bytes) else metadata.name
+		if name == OFFLINE_PLAN_METADATA:
+			model.buffers[metadata.buffer].data = data
+			return
+
+	buffer = schema_fb.BufferT()
+	buffer.data = data
+	model.buffers.append(buffer)
+
+	metadata = schema_fb.MetadataT()
+	metadata.name = OFFLINE_PLAN_METADATA
+	metadata.buffer = len(model.buffers) - 1
+	model.metadata.append(metadata)
+
+# Generate the micro_memory_plan.h file, with the size of the plan embedded in the model
+def generate_memory_plan_header(plan_size, model_path):
+	lines = [
+		'#pragma once',
+		'',
+		'// Model: {}'.format(model_path),
+		'// Bytes of the offline memory plan embedded in the model, scratch buffers are planned at runtime on top',
+		'#define MICRO_MEMORY_PLAN_SIZE {}'.format(plan_size),
+	]
+
+	with open(MEMORY_PLAN_HEADER_PATH, 'w') as f:
+		f.write('\n'.join(lines))
+
+# Path of the model with the offline memory plan, used for the build when it exists
+def planned_model_path(model_path):
+	root, ext = os.path.splitext(model_path)
+	if root.endswith("_planned"):
+		return model_path
+	return root + "_planned" + ext
 
 def main():
 	parser = argparse.ArgumentParser()
@@ -137,6 +334,27 @@ def main():
 
 	load_from_partition = os.getenv("LOAD_MODEL_FROM_PARTITION") == "1"
 
+	# Plan the memory of the model offline and build with the planned model, the plan has to fit the arena
+	if os.path.exists(MEMORY_PLAN_HEADER_PATH):
+		os.remove(MEMORY_PLAN_HEADER_PATH)
+	if planned_model_path(model_path) != model_path and os.path.exists(planned_model_path(model_path)):
+		os.remove(planned_model_path(model_path))
+
+	model = read_model(model_path)
+	plan = plan_memory(model)
+	if plan:
+		offsets, plan_size = plan
+		arena_size = os.getenv("tensor_allocation_space", "")
+		if arena_size.isdigit() and plan_size > int(arena_size):
+			print("The memory plan ({} bytes) does not fit the tensor arena ({} bytes)".format(plan_size, arena_size))
+			sys.exit(1)
+
+		embed_memory_plan(model, offsets)
+		model_path = planned_model_path(model_path)
+		write_model(model, model_path)
+		generate_memory_plan_header(plan_size, model_path)
+		print("Planned model written to {}".format(model_path))
+
 	# If the user doesn't want to load the model from a partition,
 	# we generate the micro_model.cpp file with the model data
 	if not load_from_partition:
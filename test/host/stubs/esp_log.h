@@ -0,0 +1,9 @@
+// Logging of the firmware sources built on the host
+#pragma once
+#include <errno.h>
+#include <stdio.h>
+
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ((void) 0)
+#define ESP_LOGD(tag, format, ...) ((void) 0)
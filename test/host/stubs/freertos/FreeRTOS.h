@@ -0,0 +1,10 @@
+// The parts of FreeRTOS used by the firmware sources built on the host
+#pragma once
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define portMAX_DELAY ((TickType_t) 0xffffffff)
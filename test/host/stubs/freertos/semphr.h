@@ -0,0 +1,24 @@
+// FreeRTOS mutexes on top of std::mutex, for the firmware sources built on the host
+#pragma once
+#include <mutex>
+
+#include "freertos/FreeRTOS.h"
+
+typedef std::timed_mutex* SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+	return new std::timed_mutex();
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+	if (ticks == portMAX_DELAY) {
+		semaphore->lock();
+		return pdTRUE;
+	}
+	return semaphore->try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+	semaphore->unlock();
+	return pdTRUE;
+}
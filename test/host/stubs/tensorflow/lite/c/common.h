@@ -0,0 +1,84 @@
+// The parts of the TensorFlow Lite C API used by the firmware sources built on the host,
+// with the values and layout of the real header. TfLiteContext and TfLiteNode only carry the
+// members the firmware uses.
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+	kTfLiteOk = 0,
+	kTfLiteError = 1,
+} TfLiteStatus;
+
+typedef enum {
+	kTfLiteNoType = 0,
+	kTfLiteFloat32 = 1,
+	kTfLiteInt32 = 2,
+	kTfLiteUInt8 = 3,
+	kTfLiteInt64 = 4,
+	kTfLiteString = 5,
+	kTfLiteBool = 6,
+	kTfLiteInt16 = 7,
+	kTfLiteComplex64 = 8,
+	kTfLiteInt8 = 9,
+} TfLiteType;
+
+typedef struct {
+	int size;
+	int data[];
+} TfLiteIntArray;
+
+typedef struct {
+	float scale;
+	int32_t zero_point;
+} TfLiteQuantizationParams;
+
+typedef enum {
+	kTfLiteNoQuantization = 0,
+	kTfLiteAffineQuantization = 1,
+} TfLiteQuantizationType;
+
+typedef struct {
+	TfLiteQuantizationType type;
+	void* params;
+} TfLiteQuantization;
+
+typedef union {
+	float* f;
+	int8_t* int8;
+	uint8_t* uint8;
+	int16_t* i16;
+	char* raw;
+} TfLitePtrUnion;
+
+typedef struct TfLiteTensor {
+	TfLiteType type;
+	TfLitePtrUnion data;
+	TfLiteIntArray* dims;
+	TfLiteQuantizationParams params;
+	int allocation_type;
+	size_t bytes;
+	const void* allocation;
+	const char* name;
+	void* delegate;
+	int buffer_handle;
+	bool data_is_stale;
+	bool is_variable;
+	TfLiteQuantization quantization;
+} TfLiteTensor;
+
+typedef struct TfLiteEvalTensor {
+	TfLitePtrUnion data;
+	TfLiteIntArray* dims;
+	TfLiteType type;
+} TfLiteEvalTensor;
+
+typedef struct TfLiteNode {
+	TfLiteIntArray* inputs;
+	TfLiteIntArray* outputs;
+} TfLiteNode;
+
+typedef struct TfLiteContext {
+	TfLiteEvalTensor* (*GetEvalTensor)(const struct TfLiteContext* context, int tensor_idx);
+} TfLiteContext;
@@ -0,0 +1,202 @@
+// Checks that requests received in pieces decode exactly like requests received in one go
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "DataProvider.h"
+
+static int failures = 0;
+
+static void Check(bool condition, const char* what) {
+	if (!condition) {
+		failures++;
+		printf("FAIL %s\n", what);
+	}
+}
+
+// Input tensor of the given type and shape, with its data owned by the test
+struct Tensor {
+	Tensor(TfLiteType type, std::vector<int> shape, float scale = 0.0f, int zero_point = 0) {
+		dims.push_back(shape.size());
+		dims.insert(dims.end(), shape.begin(), shape.end());
+		size_t count = 1;
+		for (int dim : shape) {
+			count *= dim;
+		}
+
+		tensor.type = type;
+		tensor.dims = reinterpret_cast<TfLiteIntArray*>(dims.data());
+		tensor.params = {scale, zero_point};
+		tensor.bytes = count * (type == kTfLiteFloat32 ? sizeof(float) : 1);
+	}
+
+	std::vector<int> dims;
+	TfLiteTensor tensor = {};
+};
+
+// Encoded sample of random values, floats within the quantized range and a bit beyond
+static std::vector<uint8_t> RandomSample(size_t size, uint8_t encoding, std::mt19937& random) {
+	std::vector<uint8_t> sample(size);
+	if (encoding == INPUT_ENCODING_FLOAT32) {
+		std::uniform_real_distribution<float> values(-1.5f, 1.5f);
+		for (size_t i = 0; i < size; i += sizeof(float)) {
+			float value = values(random);
+			memcpy(&sample[i], &value, sizeof(value));
+		}
+	} else {
+		for (uint8_t& byte : sample) {
+			byte = random() & 0xFF;
+		}
+	}
+	return sample;
+}
+
+// Decodes the sample in one piece and in pieces of random sizes, which split the float32 values anywhere
+static void CheckDecode(const Tensor& input, uint8_t encoding, const char* name) {
+	DataProvider provider;
+	provider.Init(&input.tensor);
+	Check(provider.SupportsEncoding(&input.tensor, encoding), name);
+
+	std::mt19937 random(encoding * 7 + input.tensor.type);
+	size_t size = provider.EncodedSize(&input.tensor, encoding);
+	for (int run = 0; run < 20; run++) {
+		std::vector<uint8_t> sample = RandomSample(size, encoding, random);
+		std::vector<uint8_t> whole(input.tensor.bytes), pieces(input.tensor.bytes);
+
+		Check(provider.Read(sample.data(), sample.size(), &input.tensor, encoding, whole.data()) == 0, name);
+
+		SampleProgress progress;
+		provider.Begin(progress, encoding);
+		std::uniform_int_distribution<size_t> piece_size(1, 13);
+		for (size_t offset = 0; offset < size;) {
+			size_t piece = std::min(piece_size(random), size - offset);
+			provider.Decode(progress, sample.data() + offset, piece, &input.tensor, pieces.data());
+			offset += piece;
+		}
+
+		if (whole != pieces) {
+			failures++;
+			printf("FAIL %s: the sample decodes differently in pieces\n", name);
+			return;
+		}
+	}
+}
+
+// Float32 samples quantized on the device match the kernel run over the whole sample
+static void CheckQuantized() {
+	Tensor input(kTfLiteInt8, {1, 28, 28}, 1.0f / 255.0f, -128);
+	DataProvider provider;
+	provider.Init(&input.tensor);
+
+	std::mt19937 random(5);
+	std::vector<uint8_t> sample = RandomSample(input.tensor.bytes * sizeof(float), INPUT_ENCODING_FLOAT32, random);
+	std::vector<float> values(input.tensor.bytes);
+	memcpy(values.data(), sample.data(), sample.size());
+
+	std::vector<int8_t> expected(input.tensor.bytes), actual(input.tensor.bytes);
+	QuantizeValues<int8_t>(values.data(), expected.data(), values.size(), input.tensor.params.scale,
+						   1.0f / input.tensor.params.scale, input.tensor.params.zero_point);
+	provider.Read(sample.data(), sample.size(), &input.tensor, INPUT_ENCODING_FLOAT32,
+				  reinterpret_cast<uint8_t*>(actual.data()));
+	Check(expected == actual, "float32 samples are quantized by the kernel");
+}
+
+// Parses the header one byte at a time: every prefix reports the bytes still missing, the whole header the request
+static int ParsePrefixes(DataProvider& provider, const std::vector<uint8_t>& header, Request& request,
+						 const char* name) {
+	for (size_t size = 0; size < header.size(); size++) {
+		int missing = provider.ParseRequest(header.data(), size, request);
+		if (missing <= 0 || size + missing > header.size()) {
+			failures++;
+			printf("FAIL %s: %d bytes missing after %zu of %zu\n", name, missing, size, header.size());
+			return -1;
+		}
+	}
+	return provider.ParseRequest(header.data(), header.size(), request);
+}
+
+template <typename T>
+static void Append(std::vector<uint8_t>& header, T value) {
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+	header.insert(header.end(), bytes, bytes + sizeof(T));
+}
+
+static void CheckRequests() {
+	DataProvider provider;
+	Request request;
+
+	Check(ParsePrefixes(provider, {REQUEST_INFER}, request, "infer") == 0 && request.sample_count == 1,
+		  "infer request");
+	Check(ParsePrefixes(provider, {REQUEST_INFO}, request, "info") == 0 && request.sample_count == 0,
+		  "info request");
+	Check(ParsePrefixes(provider, {REQUEST_INFER_BATCH, 32}, request, "batch") == 0 && request.sample_count == 32,
+		  "batch request");
+	Check(ParsePrefixes(provider, {REQUEST_SET_ENCODING, INPUT_ENCODING_PIXEL_UINT8}, request, "encoding") == 0 &&
+			  request.input_encoding == INPUT_ENCODING_PIXEL_UINT8,
+		  "encoding request");
+
+	std::vector<uint8_t> tagged = {REQUEST_INFER_TAGGED};
+	Append<uint32_t>(tagged, 0xA1B2C3D4);
+	Check(ParsePrefixes(provider, tagged, request, "tagged") == 0 && request.request_id == 0xA1B2C3D4,
+		  "tagged request");
+
+	std::vector<uint8_t> response = {REQUEST_SET_RESPONSE, RESPONSE_SPARSE, 3};
+	Append<float>(response, 0.25f);
+	Check(ParsePrefixes(provider, response, request, "response") == 0 && request.response_mode == RESPONSE_SPARSE &&
+			  request.top_k == 3 && request.threshold == 0.25f,
+		  "response request");
+
+	// The normalization follows the fixed part, sized by its channel count
+	std::vector<uint8_t> preprocess = {REQUEST_SET_PREPROCESS};
+	for (uint16_t value : {640, 480}) {
+		Append(preprocess, value);
+	}
+	preprocess.push_back(3);
+	for (uint16_t value : {10, 20, 300, 200}) {
+		Append(preprocess, value);
+	}
+	preprocess.push_back(RESIZE_BILINEAR);
+	for (float value : {0.1f, 0.2f, 0.3f, 1.0f, 2.0f, 3.0f}) {
+		Append(preprocess, value);
+	}
+	PreprocessConfig& config = request.preprocess;
+	Check(ParsePrefixes(provider, preprocess, request, "preprocess") == 0 && request.skip == 0 &&
+			  config.frame_width == 640 && config.frame_height == 480 && config.channels == 3 &&
+			  config.crop_x == 10 && config.crop_y == 20 && config.crop_width == 300 && config.crop_height == 200 &&
+			  config.resize_mode == RESIZE_BILINEAR && config.mean[2] == 0.3f && config.std[0] == 1.0f &&
+			  config.std[2] == 3.0f,
+		  "preprocess request");
+	Check(preprocess.size() <= DataProvider::kMaxRequestHeaderSize, "preprocess header fits");
+
+	// An invalid channel count completes the header without the normalization, which is skipped
+	preprocess[5] = PreprocessConfig::kMaxChannels + 1;
+	preprocess.resize(15);
+	Check(ParsePrefixes(provider, preprocess, request, "invalid channels") == 0 &&
+			  request.skip == 2 * (PreprocessConfig::kMaxChannels + 1) * sizeof(float),
+		  "invalid channel count is skipped");
+
+	uint8_t batch[] = {REQUEST_INFER_BATCH, MAX_BATCH_SIZE + 1};
+	Check(provider.ParseRequest(batch, sizeof(batch), request) < 0, "oversized batch is malformed");
+	batch[1] = 0;
+	Check(provider.ParseRequest(batch, sizeof(batch), request) < 0, "empty batch is malformed");
+	uint8_t unknown = 0x7F;
+	Check(provider.ParseRequest(&unknown, 1, request) < 0, "unknown request is malformed");
+}
+
+int main() {
+	CheckDecode(Tensor(kTfLiteInt8, {1, 28, 28}, 1.0f / 255.0f, -128), INPUT_ENCODING_FLOAT32, "float32 to int8");
+	CheckDecode(Tensor(kTfLiteUInt8, {1, 28, 28}, 0.0078125f, 128), INPUT_ENCODING_FLOAT32, "float32 to uint8");
+	CheckDecode(Tensor(kTfLiteFloat32, {1, 28, 28}), INPUT_ENCODING_FLOAT32, "float32 to float32");
+	CheckDecode(Tensor(kTfLiteInt8, {1, 28, 28}, 1.0f / 255.0f, -128), INPUT_ENCODING_QUANT_INT8, "int8 to int8");
+	CheckDecode(Tensor(kTfLiteInt8, {1, 28, 28}, 1.0f / 255.0f, -128), INPUT_ENCODING_QUANT_UINT8, "uint8 to int8");
+	CheckDecode(Tensor(kTfLiteUInt8, {1, 28, 28}, 1.0f / 255.0f, 0), INPUT_ENCODING_QUANT_UINT8, "uint8 to uint8");
+	CheckDecode(Tensor(kTfLiteInt8, {1, 28, 28}, 1.0f / 255.0f, -128), INPUT_ENCODING_PIXEL_UINT8, "pixel to int8");
+	CheckDecode(Tensor(kTfLiteFloat32, {1, 28, 28}), INPUT_ENCODING_PIXEL_UINT8, "pixel to float32");
+	CheckQuantized();
+	CheckRequests();
+
+	printf("%s: %d failures\n", failures ? "FAILED" : "PASSED", failures);
+	return failures ? 1 : 0;
+}
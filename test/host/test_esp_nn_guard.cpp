@@ -0,0 +1,110 @@
+// Two interpreters invoking a kernel that, like the esp-nn ones, keeps its scratch buffer in a file-static pointer
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+
+#include "esp_nn_guard.h"
+
+static int failures = 0;
+
+static void Check(bool condition, const char* what) {
+	if (!condition) {
+		failures++;
+		printf("FAIL %s\n", what);
+	}
+}
+
+// Layout of a registration as far as the guard is concerned
+struct Registration {
+	TfLiteStatus (*invoke)(TfLiteContext* context, TfLiteNode* node);
+};
+
+// Set by a kernel before it runs, as esp_nn_set_conv_scratch_buf() does
+static int32_t* scratch = nullptr;
+// Whether the guard held the lock during the last run of FloatKernel
+static bool float_locked = false;
+
+static TfLiteStatus ScratchKernel(TfLiteContext* context, TfLiteNode* node) {
+	int32_t own[64];
+	scratch = own;
+	for (int i = 0; i < 64; i++) {
+		scratch[i] = node->outputs->data[0];
+		std::this_thread::yield();
+	}
+	for (int i = 0; i < 64; i++) {
+		if (own[i] != node->outputs->data[0]) {
+			return kTfLiteError;
+		}
+	}
+	return scratch == own ? kTfLiteOk : kTfLiteError;
+}
+
+static TfLiteStatus FloatKernel(TfLiteContext* context, TfLiteNode* node) {
+	SemaphoreHandle_t lock = esp_nn_scratch_lock();
+	float_locked = !lock->try_lock();
+	if (!float_locked) {
+		lock->unlock();
+	}
+	return kTfLiteOk;
+}
+
+static TfLiteEvalTensor tensors[2];
+
+static TfLiteEvalTensor* GetEvalTensor(const TfLiteContext* context, int tensor_idx) {
+	return &tensors[tensor_idx];
+}
+
+// A node reading tensor `input`, with the interpreter it runs on as its output
+struct Node {
+	int inputs[2];
+	int outputs[2];
+	TfLiteNode node;
+
+	Node(int input, int interpreter) : inputs{1, input}, outputs{1, interpreter} {
+		node.inputs = reinterpret_cast<TfLiteIntArray*>(inputs);
+		node.outputs = reinterpret_cast<TfLiteIntArray*>(outputs);
+	}
+};
+
+// Runs the kernel on two threads at once and counts the runs that saw the scratch buffer of the other one
+static int RunConcurrently(Registration registration) {
+	const int kRuns = 2000;
+	int errors[2] = {};
+	std::thread interpreters[2];
+	for (int i = 0; i < 2; i++) {
+		interpreters[i] = std::thread([&, i] {
+			TfLiteContext context = {GetEvalTensor};
+			Node node(0, i + 1);
+			for (int run = 0; run < kRuns; run++) {
+				errors[i] += registration.invoke(&context, &node.node) != kTfLiteOk;
+			}
+		});
+	}
+	for (std::thread& interpreter : interpreters) {
+		interpreter.join();
+	}
+	return errors[0] + errors[1];
+}
+
+int main() {
+	tensors[0].type = kTfLiteInt8;
+	tensors[1].type = kTfLiteFloat32;
+
+	Check(RunConcurrently({ScratchKernel}) > 0, "the unguarded kernel races on its scratch buffer");
+
+	Registration guarded = EspNnScratchGuard<3>::Wrap(Registration{ScratchKernel});
+	Check(RunConcurrently(guarded) == 0, "the guarded kernel runs on one interpreter at a time");
+
+	// Float inputs run the reference kernels, which share nothing
+	Registration floats = EspNnScratchGuard<25>::Wrap(Registration{FloatKernel});
+	TfLiteContext context = {GetEvalTensor};
+	Node float_node(1, 1);
+	floats.invoke(&context, &float_node.node);
+	Check(!float_locked, "kernels with float inputs run without the lock");
+	Node int8_node(0, 1);
+	floats.invoke(&context, &int8_node.node);
+	Check(float_locked, "kernels with int8 inputs run with the lock");
+
+	printf("%s: %d failures\n", failures ? "FAILED" : "PASSED", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,273 @@
+// Checks the frame preprocessing of INPUT_ENCODING_FRAME_UINT8 against a float reference
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "Preprocessor.h"
+
+static int failures = 0;
+
+static void Check(bool condition, const char* what) {
+	if (!condition) {
+		failures++;
+		printf("FAIL %s\n", what);
+	}
+}
+
+// Input tensor of the given type and NHWC shape, with its data owned by the test
+struct Tensor {
+	Tensor(TfLiteType type, std::vector<int> shape, float scale = 0.0f, int zero_point = 0) {
+		dims.push_back(shape.size());
+		dims.insert(dims.end(), shape.begin(), shape.end());
+		size_t count = 1;
+		for (int dim : shape) {
+			count *= dim;
+		}
+
+		tensor.type = type;
+		tensor.dims = reinterpret_cast<TfLiteIntArray*>(dims.data());
+		tensor.params = {scale, zero_point};
+		tensor.bytes = count * (type == kTfLiteFloat32 ? sizeof(float) : 1);
+		data.resize(tensor.bytes);
+	}
+
+	std::vector<int> dims;
+	std::vector<uint8_t> data;
+	TfLiteTensor tensor = {};
+};
+
+static PreprocessConfig FrameConfig(int width, int height, int channels, uint8_t resize_mode) {
+	PreprocessConfig config = {};
+	config.frame_width = width;
+	config.frame_height = height;
+	config.channels = channels;
+	config.resize_mode = resize_mode;
+	for (int c = 0; c < channels; c++) {
+		config.mean[c] = 0.0f;
+		config.std[c] = 1.0f;
+	}
+	return config;
+}
+
+static std::vector<uint8_t> RandomFrame(const PreprocessConfig& config, uint32_t seed) {
+	std::mt19937 random(seed);
+	std::vector<uint8_t> frame(config.frame_width * config.frame_height * config.channels);
+	for (uint8_t& pixel : frame) {
+		pixel = random() & 0xFF;
+	}
+	return frame;
+}
+
+// Feeds the frame in pieces of every size from 1 byte to more than a row, like the socket delivers them
+static void Run(Preprocessor& preprocessor, const std::vector<uint8_t>& frame, Tensor& input) {
+	preprocessor.Begin();
+	size_t piece = 1;
+	for (size_t offset = 0; offset < frame.size(); offset += piece, piece = piece % 97 + 1) {
+		piece = std::min(piece, frame.size() - offset);
+		preprocessor.Feed(frame.data() + offset, piece, input.data.data());
+	}
+}
+
+// Pixel value of the crop of `frame` at the output position, with half pixel centers, in floating point
+static float ReferencePixel(const PreprocessConfig& config, const std::vector<uint8_t>& frame, int output_width,
+							int output_height, int x, int y, int c) {
+	int crop_width = config.crop_width ? config.crop_width : config.frame_width;
+	int crop_height = config.crop_height ? config.crop_height : config.frame_height;
+
+	if (config.resize_mode == RESIZE_NEAREST) {
+		int source_x = config.crop_x + (2 * x + 1) * crop_width / (2 * output_width);
+		int source_y = config.crop_y + (2 * y + 1) * crop_height / (2 * output_height);
+		return frame[(source_y * config.frame_width + source_x) * config.channels + c];
+	}
+
+	double source_x = std::clamp((x + 0.5) * crop_width / output_width - 0.5, 0.0, crop_width - 1.0);
+	double source_y = std::clamp((y + 0.5) * crop_height / output_height - 0.5, 0.0, crop_height - 1.0);
+	int x0 = static_cast<int>(source_x);
+	int y0 = static_cast<int>(source_y);
+	int x1 = std::min(x0 + 1, crop_width - 1);
+	int y1 = std::min(y0 + 1, crop_height - 1);
+	double fx = source_x - x0;
+	double fy = source_y - y0;
+
+	auto pixel = [&](int px, int py) {
+		return static_cast<double>(
+			frame[((config.crop_y + py) * config.frame_width + config.crop_x + px) * config.channels + c]);
+	};
+	double top = pixel(x0, y0) * (1 - fx) + pixel(x1, y0) * fx;
+	double bottom = pixel(x0, y1) * (1 - fx) + pixel(x1, y1) * fx;
+	return static_cast<float>(top * (1 - fy) + bottom * fy);
+}
+
+// Resizes a frame into a float tensor normalized to [0, 1], and compares every
+// value with the reference within `tolerance` pixel levels
+static void CheckResize(PreprocessConfig config, int output_width, int output_height, float tolerance,
+						const char* name) {
+	Tensor input(kTfLiteFloat32, {1, output_height, output_width, config.channels});
+	Preprocessor preprocessor;
+	Check(preprocessor.Configure(config, &input.tensor) == 0, name);
+	Check(preprocessor.FrameSize() == static_cast<size_t>(config.frame_width * config.frame_height * config.channels),
+		  "frame size");
+
+	std::vector<uint8_t> frame = RandomFrame(config, output_width * 31 + output_height);
+	Run(preprocessor, frame, input);
+
+	const float* values = reinterpret_cast<const float*>(input.data.data());
+	float worst = 0.0f;
+	for (int y = 0; y < output_height; y++) {
+		for (int x = 0; x < output_width; x++) {
+			for (int c = 0; c < config.channels; c++) {
+				float expected = ReferencePixel(config, frame, output_width, output_height, x, y, c);
+				float actual = values[(y * output_width + x) * config.channels + c] * 255.0f;
+				worst = std::max(worst, std::fabs(actual - expected));
+			}
+		}
+	}
+	if (worst > tolerance) {
+		failures++;
+		printf("FAIL %s: off by %.3f levels (tolerance %.3f)\n", name, worst, tolerance);
+	}
+}
+
+// Every pixel value of every channel goes through the lookup table of a quantized tensor
+static void CheckQuantized() {
+	const int channels = 3;
+	const float scale = 0.0078125f;
+	const int zero_point = -1;
+	PreprocessConfig config = FrameConfig(16, 16, channels, RESIZE_NEAREST);
+	const float mean[channels] = {0.485f, 0.456f, 0.406f};
+	const float std[channels] = {0.229f, 0.224f, 0.225f};
+	for (int c = 0; c < channels; c++) {
+		config.mean[c] = mean[c];
+		config.std[c] = std[c];
+	}
+
+	// One frame row holds every pixel value of every channel
+	Tensor input(kTfLiteInt8, {1, 16, 16, channels}, scale, zero_point);
+	Preprocessor preprocessor;
+	Check(preprocessor.Configure(config, &input.tensor) == 0, "int8 configuration");
+	std::vector<uint8_t> frame(16 * 16 * channels);
+	for (size_t i = 0; i < frame.size(); i++) {
+		frame[i] = (i / channels) & 0xFF;
+	}
+	Run(preprocessor, frame, input);
+
+	for (size_t i = 0; i < frame.size(); i++) {
+		int c = i % channels;
+		float value = (frame[i] / 255.0f - mean[c]) / std[c];
+		double quantized = std::round(value / scale) + zero_point;
+		int expected = static_cast<int>(std::clamp(quantized, -128.0, 127.0));
+		int actual = static_cast<int8_t>(input.data[i]);
+		if (actual != expected) {
+			failures++;
+			printf("FAIL int8: pixel %d of channel %d: %d, expected %d\n", frame[i], c, actual, expected);
+		}
+	}
+}
+
+static void CheckRejected(PreprocessConfig config, const Tensor& input, const char* name) {
+	Preprocessor preprocessor;
+	if (preprocessor.Configure(config, &input.tensor) == 0 || preprocessor.IsConfigured()) {
+		failures++;
+		printf("FAIL %s is accepted\n", name);
+	}
+}
+
+static void CheckInvalid() {
+	Tensor input(kTfLiteFloat32, {1, 28, 28, 1});
+	PreprocessConfig config = FrameConfig(56, 56, 1, RESIZE_BILINEAR);
+
+	PreprocessConfig channels = FrameConfig(56, 56, 3, RESIZE_BILINEAR);
+	CheckRejected(channels, input, "a channel mismatch");
+	channels.channels = 0;
+	CheckRejected(channels, Tensor(kTfLiteFloat32, {1, 28, 28, 0}), "zero channels");
+	channels.channels = PreprocessConfig::kMaxChannels + 1;
+	CheckRejected(channels, Tensor(kTfLiteFloat32, {1, 28, 28, channels.channels}), "too many channels");
+
+	PreprocessConfig crop = config;
+	crop.crop_x = 30;
+	crop.crop_width = 28;
+	crop.crop_height = 28;
+	CheckRejected(crop, input, "a crop out of the frame");
+
+	PreprocessConfig mode = config;
+	mode.resize_mode = RESIZE_BILINEAR + 1;
+	CheckRejected(mode, input, "an unknown resize mode");
+
+	PreprocessConfig deviation = config;
+	deviation.std[0] = 0.0f;
+	CheckRejected(deviation, input, "a zero standard deviation");
+
+	PreprocessConfig wide = config;
+	wide.frame_width = Preprocessor::kMaxRowSize + 1;
+	CheckRejected(wide, input, "a frame row over the limit");
+
+	Tensor flat(kTfLiteFloat32, {1, 784});
+	Tensor integer(kTfLiteInt32, {1, 28, 28, 1});
+	CheckRejected(config, flat, "a tensor without spatial dimensions");
+	CheckRejected(config, integer, "an int32 tensor");
+
+	Check(Preprocessor::Supports(&input.tensor), "float tensors are supported");
+	Tensor quantized(kTfLiteUInt8, {1, 28, 28}, 1.0f / 255, 0);
+	Check(Preprocessor::Supports(&quantized.tensor), "uint8 tensors are supported");
+	Check(!Preprocessor::Supports(&flat.tensor), "flat tensors are not supported");
+	Check(!Preprocessor::Supports(&integer.tensor), "int32 tensors are not supported");
+}
+
+// A rejected configuration must not change the one in use: frames keep their size and fit the buffers built for it
+static void CheckRejectedKeepsConfig() {
+	Tensor input(kTfLiteFloat32, {1, 28, 28, 1});
+	PreprocessConfig accepted = FrameConfig(56, 56, 1, RESIZE_BILINEAR);
+	Preprocessor preprocessor;
+	Check(preprocessor.Configure(accepted, &input.tensor) == 0, "the first configuration");
+
+	Tensor expected(kTfLiteFloat32, {1, 28, 28, 1});
+	std::vector<uint8_t> frame = RandomFrame(accepted, 77);
+	Run(preprocessor, frame, expected);
+
+	PreprocessConfig wide = FrameConfig(1000, 56, 3, RESIZE_BILINEAR);
+	Check(preprocessor.Configure(wide, &input.tensor) != 0, "a channel mismatch after a valid configuration");
+	PreprocessConfig deviation = FrameConfig(1000, 56, 1, RESIZE_BILINEAR);
+	deviation.std[0] = 0.0f;
+	Check(preprocessor.Configure(deviation, &input.tensor) != 0, "a zero deviation after a valid configuration");
+
+	Check(preprocessor.IsConfigured(), "the first configuration stays in use");
+	Check(preprocessor.FrameSize() == frame.size(), "the frame size of the first configuration stays");
+	Run(preprocessor, frame, input);
+	Check(input.data == expected.data, "frames are preprocessed as before the rejected configurations");
+}
+
+int main() {
+	// Same size: both modes copy the frame
+	CheckResize(FrameConfig(28, 28, 1, RESIZE_NEAREST), 28, 28, 0.0f, "identity, nearest");
+	CheckResize(FrameConfig(28, 28, 1, RESIZE_BILINEAR), 28, 28, 0.0f, "identity, bilinear");
+
+	// Nearest neighbour picks the same pixels as the reference
+	CheckResize(FrameConfig(84, 84, 1, RESIZE_NEAREST), 28, 28, 0.0f, "downscale, nearest");
+	CheckResize(FrameConfig(20, 13, 3, RESIZE_NEAREST), 28, 28, 0.0f, "upscale, nearest");
+
+	// Bilinear runs on source positions truncated to 1/256 of a pixel, which moves a value by less
+	// than 255/256 levels per axis, and rounds the result by half a level at most
+	const float kBilinearTolerance = 2 * 255.0f / 256.0f + 0.5f;
+	CheckResize(FrameConfig(96, 64, 1, RESIZE_BILINEAR), 28, 28, kBilinearTolerance, "downscale, bilinear");
+	CheckResize(FrameConfig(17, 23, 3, RESIZE_BILINEAR), 28, 28, kBilinearTolerance, "upscale, bilinear");
+
+	PreprocessConfig crop = FrameConfig(64, 48, 3, RESIZE_BILINEAR);
+	crop.crop_x = 10;
+	crop.crop_y = 5;
+	crop.crop_width = 40;
+	crop.crop_height = 30;
+	CheckResize(crop, 28, 28, kBilinearTolerance, "crop, bilinear");
+	crop.resize_mode = RESIZE_NEAREST;
+	CheckResize(crop, 28, 28, 0.0f, "crop, nearest");
+
+	CheckQuantized();
+	CheckInvalid();
+	CheckRejectedKeepsConfig();
+
+	printf("%s: %d failures\n", failures ? "FAILED" : "PASSED", failures);
+	return failures ? 1 : 0;
+}
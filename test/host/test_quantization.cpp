@@ -0,0 +1,139 @@
+// Compares the (de)quantize kernels with the scalar code they replaced, bit for bit
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "quantization.h"
+
+static int failures = 0;
+
+// Scalar reference of the input path: divide, std::round, add the zero point and clamp.
+// Saturated in double so that it is defined over the whole float range, NaN maps to the lower bound.
+template <typename T>
+static T ReferenceQuantize(float input, float scale, int zero_point) {
+	constexpr double kMin = std::numeric_limits<T>::min();
+	constexpr double kMax = std::numeric_limits<T>::max();
+	if (std::isnan(input)) {
+		return static_cast<T>(kMin);
+	}
+	double value = static_cast<double>(std::round(input / scale)) + zero_point;
+	return static_cast<T>(value < kMin ? kMin : value > kMax ? kMax : value);
+}
+
+// Scalar reference of the output path
+template <typename T>
+static float ReferenceDequantize(T value, float scale, int zero_point) {
+	return (static_cast<int>(value) - zero_point) * scale;
+}
+
+static float FromBits(uint32_t bits) {
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+// Runs the kernel over the inputs in one call and checks every element against the reference
+template <typename T>
+static void CheckQuantize(const std::vector<float>& inputs, float scale, int zero_point, const char* name) {
+	std::vector<T> outputs(inputs.size());
+	QuantizeValues<T>(inputs.data(), outputs.data(), inputs.size(), scale, 1.0f / scale, zero_point);
+
+	int reported = 0;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		T expected = ReferenceQuantize<T>(inputs[i], scale, zero_point);
+		if (outputs[i] != expected) {
+			failures++;
+			if (reported++ < 5) {
+				printf("FAIL %s: quantize(%.9g) with scale %.9g, zero point %d: %d, expected %d\n", name,
+					   inputs[i], scale, zero_point, static_cast<int>(outputs[i]), static_cast<int>(expected));
+			}
+		}
+	}
+}
+
+// Inputs around every quantization step of the range and the midpoints between them, including the
+// exact ties, their neighbours within 8 ulps, and values far enough out to saturate
+static std::vector<float> StepInputs(float scale) {
+	std::vector<float> inputs;
+	for (int step = -600; step <= 600; step++) {
+		for (float center : {step * scale, (step + 0.5f) * scale}) {
+			float value = center;
+			for (int i = 0; i < 8; i++) {
+				value = std::nextafter(value, -INFINITY);
+			}
+			for (int i = 0; i < 17; i++) {
+				inputs.push_back(value);
+				value = std::nextafter(value, INFINITY);
+			}
+		}
+	}
+	return inputs;
+}
+
+static std::vector<float> SpecialInputs() {
+	constexpr float kMax = std::numeric_limits<float>::max();
+	constexpr float kDenorm = std::numeric_limits<float>::denorm_min();
+	return {0.0f, -0.0f, kDenorm, -kDenorm, std::numeric_limits<float>::min(), 0.5f, -0.5f, 1.5f, -1.5f,
+			2.5f, -2.5f, 1e6f, -1e6f, 1e30f, -1e30f, kMax, -kMax, INFINITY, -INFINITY, NAN, -NAN};
+}
+
+template <typename T>
+static void CheckQuantizeScale(float scale, int zero_point) {
+	CheckQuantize<T>(StepInputs(scale), scale, zero_point, "steps");
+	CheckQuantize<T>(SpecialInputs(), scale, zero_point, "special");
+
+	// Every 4093rd bit pattern, so that the sweep crosses every exponent of both signs
+	std::vector<float> inputs;
+	for (uint64_t bits = 0; bits <= 0xFFFFFFFFull; bits += 4093) {
+		inputs.push_back(FromBits(static_cast<uint32_t>(bits)));
+	}
+	CheckQuantize<T>(inputs, scale, zero_point, "sweep");
+}
+
+template <typename T>
+static void CheckDequantize(float scale, int zero_point) {
+	std::vector<T> inputs;
+	for (int value = std::numeric_limits<T>::min(); value <= std::numeric_limits<T>::max(); value++) {
+		inputs.push_back(static_cast<T>(value));
+	}
+
+	std::vector<float> outputs(inputs.size());
+	DequantizeValues<T, true>(inputs.data(), outputs.data(), inputs.size(), scale, zero_point);
+	for (size_t i = 0; i < inputs.size(); i++) {
+		float expected = ReferenceDequantize(inputs[i], scale, zero_point);
+		if (memcmp(&outputs[i], &expected, sizeof(float)) != 0) {
+			failures++;
+			printf("FAIL dequantize(%d) with scale %.9g, zero point %d: %.9g, expected %.9g\n",
+				   static_cast<int>(inputs[i]), scale, zero_point, outputs[i], expected);
+		}
+	}
+}
+
+int main() {
+	// Scales of the bundled models and a few arbitrary ones, including a power of two with exact ties
+	std::vector<float> scales = {1.0f / 255.0f, 0.003921569f, 0.0078125f, 0.02352941f, 0.1f, 1.0f, 0.0123f};
+	std::mt19937 random(1234);
+	std::uniform_real_distribution<float> exponent(-12.0f, 4.0f);
+	for (int i = 0; i < 8; i++) {
+		scales.push_back(std::exp2(exponent(random)));
+	}
+
+	for (float scale : scales) {
+		for (int zero_point : {-128, -3, 0, 127}) {
+			CheckQuantizeScale<int8_t>(scale, zero_point);
+			CheckDequantize<int8_t>(scale, zero_point);
+			CheckDequantize<int16_t>(scale, zero_point);
+		}
+		for (int zero_point : {0, 128, 255}) {
+			CheckQuantizeScale<uint8_t>(scale, zero_point);
+			CheckDequantize<uint8_t>(scale, zero_point);
+		}
+	}
+
+	printf("%s: %d failures over %zu scales\n", failures ? "FAILED" : "PASSED", failures, scales.size());
+	return failures ? 1 : 0;
+}
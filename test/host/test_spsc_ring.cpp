@@ -0,0 +1,77 @@
+// Streams bytes through the reply ring between two threads, in writes and reads of random sizes that wrap anywhere
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "spsc_ring.h"
+
+static int failures = 0;
+
+static void Check(bool condition, const char* what) {
+	if (!condition) {
+		failures++;
+		printf("FAIL %s\n", what);
+	}
+}
+
+int main() {
+	SpscByteRing ring;
+	Check(ring.Init(100) && ring.Capacity() == 128, "the capacity is rounded up to a power of two");
+	Check(ring.Empty() && ring.Free() == 128, "a new ring is empty");
+
+	uint8_t bytes[129] = {};
+	Check(!ring.Write(bytes, 129) && ring.Empty(), "a write larger than the free space is refused");
+	Check(ring.Write(bytes, 100) && !ring.Write(bytes, 29) && ring.Free() == 28,
+		  "a write is refused once the ring holds too much");
+	const uint8_t* data;
+	ring.Consume(ring.Peek(&data));
+	Check(ring.Empty() && ring.Free() == 128, "a refused write leaves nothing behind");
+
+	// Byte i of the stream is i modulo 251, so that a lost, repeated or reordered byte shows
+	const size_t kStreamSize = 1 << 20;
+	std::thread producer([&] {
+		std::mt19937 random(1);
+		std::uniform_int_distribution<size_t> write_size(1, 60);
+		std::vector<uint8_t> data;
+		for (size_t position = 0; position < kStreamSize;) {
+			size_t size = std::min(write_size(random), kStreamSize - position);
+			while (ring.Free() < size) {
+				std::this_thread::yield();
+			}
+			data.resize(size);
+			for (size_t i = 0; i < size; i++) {
+				data[i] = (position + i) % 251;
+			}
+			Check(ring.Write(data.data(), size), "a write within the free space succeeds");
+			position += size;
+		}
+	});
+
+	std::mt19937 random(2);
+	std::uniform_int_distribution<size_t> read_size(1, 70);
+	size_t position = 0;
+	int mismatches = 0;
+	while (position < kStreamSize) {
+		const uint8_t* data;
+		size_t size = std::min(ring.Peek(&data), read_size(random));
+		if (!size) {
+			std::this_thread::yield();
+			continue;
+		}
+		for (size_t i = 0; i < size; i++) {
+			mismatches += data[i] != (position + i) % 251;
+		}
+		ring.Consume(size);
+		position += size;
+	}
+	producer.join();
+
+	Check(mismatches == 0, "the bytes arrive in order");
+	Check(ring.Empty(), "the ring is empty once the stream is read");
+
+	printf("%s: %d failures\n", failures ? "FAILED" : "PASSED", failures);
+	return failures ? 1 : 0;
+}